@@ -0,0 +1,51 @@
+/*
+ * GNOME Online Miners - crawls through your online content
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#include "config.h"
+
+/* hosts all the miners in one process, each one still owning the bus
+ * name and object path of its own daemon
+ */
+#define INSIDE_MINER
+#define ADD_MINERS() G_STMT_START {                                     \
+    add_miner ("FACEBOOK", GOM_TYPE_FACEBOOK_MINER,                     \
+               "org.gnome.OnlineMiners.Facebook",                       \
+               "/org/gnome/OnlineMiners/Facebook");                     \
+    add_miner ("FLICKR", GOM_TYPE_FLICKR_MINER,                         \
+               "org.gnome.OnlineMiners.Flickr",                         \
+               "/org/gnome/OnlineMiners/Flickr");                       \
+    add_miner ("GDATA", GOM_TYPE_GDATA_MINER,                           \
+               "org.gnome.OnlineMiners.GData",                          \
+               "/org/gnome/OnlineMiners/GData");                        \
+    add_miner ("OWNCLOUD", GOM_TYPE_OWNCLOUD_MINER,                     \
+               "org.gnome.OnlineMiners.Owncloud",                       \
+               "/org/gnome/OnlineMiners/Owncloud");                     \
+    add_miner ("ZPJ", GOM_TYPE_ZPJ_MINER,                               \
+               "org.gnome.OnlineMiners.Zpj",                            \
+               "/org/gnome/OnlineMiners/Zpj");                          \
+  } G_STMT_END
+
+#include "gom-facebook-miner.h"
+#include "gom-flickr-miner.h"
+#include "gom-gdata-miner.h"
+#include "gom-owncloud-miner.h"
+#include "gom-zpj-miner.h"
+#include "gom-miner-main.c"
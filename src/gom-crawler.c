@@ -0,0 +1,223 @@
+/*
+ * GNOME Online Miners - crawls through your online content
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#include "config.h"
+
+#include "gom-crawler.h"
+
+struct _GomCrawler {
+  GCancellable *cancellable;
+  GDestroyNotify node_free;
+  GError *error;
+  GMainLoop *loop;
+  GQueue *frontier;
+  GomCrawlerListFunc list_func;
+  gboolean dispatching;
+  gpointer user_data;
+  guint max_depth;
+  guint n_active;
+  guint width;
+};
+
+typedef struct {
+  gpointer node;
+  guint depth;
+} CrawlerNode;
+
+static void
+gom_crawler_clear_frontier (GomCrawler *self)
+{
+  CrawlerNode *cnode;
+
+  while ((cnode = g_queue_pop_head (self->frontier)) != NULL)
+    {
+      if (self->node_free != NULL)
+        self->node_free (cnode->node);
+
+      g_slice_free (CrawlerNode, cnode);
+    }
+}
+
+static gboolean
+gom_crawler_is_stopped (GomCrawler *self)
+{
+  return (self->error != NULL || g_cancellable_is_cancelled (self->cancellable));
+}
+
+static void
+gom_crawler_dispatch (GomCrawler *self)
+{
+  /* listings that complete synchronously end up here again through
+   * gom_crawler_add and gom_crawler_done, and are picked up by the
+   * loop below instead of recursing
+   */
+  if (self->dispatching)
+    return;
+
+  self->dispatching = TRUE;
+
+  if (gom_crawler_is_stopped (self))
+    gom_crawler_clear_frontier (self);
+
+  /* the most recently found nodes go first, which keeps the crawl
+   * close to depth-first and the frontier short
+   */
+  while (self->n_active < self->width && !g_queue_is_empty (self->frontier))
+    {
+      CrawlerNode *cnode;
+      gpointer node;
+      guint depth;
+
+      cnode = g_queue_pop_tail (self->frontier);
+      node = cnode->node;
+      depth = cnode->depth;
+      g_slice_free (CrawlerNode, cnode);
+
+      self->n_active++;
+      self->list_func (self, node, depth, self->user_data);
+
+      if (gom_crawler_is_stopped (self))
+        gom_crawler_clear_frontier (self);
+    }
+
+  self->dispatching = FALSE;
+
+  if (self->n_active == 0 && self->loop != NULL)
+    g_main_loop_quit (self->loop);
+}
+
+/* width is how many nodes can be listed at the same time, and nodes
+ * deeper than max_depth are not listed at all; asynchronous listings
+ * run on the thread-default context of the caller of gom_crawler_run
+ */
+GomCrawler *
+gom_crawler_new (guint width,
+                 guint max_depth,
+                 GomCrawlerListFunc list_func,
+                 GDestroyNotify node_free,
+                 gpointer user_data,
+                 GCancellable *cancellable)
+{
+  GomCrawler *self;
+
+  self = g_slice_new0 (GomCrawler);
+  self->width = MAX (width, 1);
+  self->max_depth = max_depth;
+  self->list_func = list_func;
+  self->node_free = node_free;
+  self->user_data = user_data;
+  self->frontier = g_queue_new ();
+
+  if (cancellable != NULL)
+    self->cancellable = g_object_ref (cancellable);
+
+  return self;
+}
+
+void
+gom_crawler_free (GomCrawler *self)
+{
+  g_assert (self->n_active == 0);
+
+  gom_crawler_clear_frontier (self);
+  g_queue_free (self->frontier);
+  g_clear_error (&self->error);
+  g_clear_object (&self->cancellable);
+
+  g_slice_free (GomCrawler, self);
+}
+
+/* takes ownership of node; returns FALSE, after freeing it, if node
+ * is deeper than the crawler is allowed to go
+ */
+gboolean
+gom_crawler_add (GomCrawler *self,
+                 gpointer node,
+                 guint depth)
+{
+  CrawlerNode *cnode;
+
+  if (depth > self->max_depth)
+    {
+      g_debug ("Not crawling beyond depth %u", self->max_depth);
+
+      if (self->node_free != NULL)
+        self->node_free (node);
+
+      return FALSE;
+    }
+
+  cnode = g_slice_new (CrawlerNode);
+  cnode->node = node;
+  cnode->depth = depth;
+  g_queue_push_tail (self->frontier, cnode);
+
+  gom_crawler_dispatch (self);
+  return TRUE;
+}
+
+void
+gom_crawler_done (GomCrawler *self)
+{
+  g_assert (self->n_active > 0);
+
+  self->n_active--;
+  gom_crawler_dispatch (self);
+}
+
+/* stops handing out nodes, and makes gom_crawler_run fail with the
+ * first error passed here once the listings in flight are done
+ */
+void
+gom_crawler_abort (GomCrawler *self,
+                   const GError *error)
+{
+  if (self->error == NULL)
+    self->error = g_error_copy (error);
+
+  gom_crawler_dispatch (self);
+}
+
+gboolean
+gom_crawler_run (GomCrawler *self,
+                 GError **error)
+{
+  gom_crawler_dispatch (self);
+
+  if (self->n_active > 0)
+    {
+      self->loop = g_main_loop_new (g_main_context_get_thread_default (), FALSE);
+      g_main_loop_run (self->loop);
+      g_clear_pointer (&self->loop, g_main_loop_unref);
+    }
+
+  if (self->error != NULL)
+    {
+      g_propagate_error (error, self->error);
+      self->error = NULL;
+      return FALSE;
+    }
+
+  if (g_cancellable_set_error_if_cancelled (self->cancellable, error))
+    return FALSE;
+
+  return TRUE;
+}
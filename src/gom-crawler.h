@@ -0,0 +1,63 @@
+/*
+ * GNOME Online Miners - crawls through your online content
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#ifndef __GOM_CRAWLER_H__
+#define __GOM_CRAWLER_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GomCrawler GomCrawler;
+
+/* starts listing node, which now belongs to the callee; the children
+ * are handed back with gom_crawler_add and the end of the listing,
+ * synchronous or not, is signalled with gom_crawler_done
+ */
+typedef void (*GomCrawlerListFunc) (GomCrawler *crawler,
+                                    gpointer node,
+                                    guint depth,
+                                    gpointer user_data);
+
+GomCrawler *gom_crawler_new (guint width,
+                             guint max_depth,
+                             GomCrawlerListFunc list_func,
+                             GDestroyNotify node_free,
+                             gpointer user_data,
+                             GCancellable *cancellable);
+
+void gom_crawler_free (GomCrawler *self);
+
+gboolean gom_crawler_add (GomCrawler *self,
+                          gpointer node,
+                          guint depth);
+
+void gom_crawler_done (GomCrawler *self);
+
+void gom_crawler_abort (GomCrawler *self,
+                        const GError *error);
+
+gboolean gom_crawler_run (GomCrawler *self,
+                          GError **error);
+
+G_END_DECLS
+
+#endif /* __GOM_CRAWLER_H__ */
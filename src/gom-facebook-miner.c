@@ -23,16 +23,203 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include <goa/goa.h>
 #include <gfbgraph/gfbgraph.h>
 #include <gfbgraph/gfbgraph-goa-authorizer.h>
+#include <json-glib/json-glib.h>
+#include <rest/rest-proxy.h>
 
 #include "gom-facebook-miner.h"
+#include "gom-utils.h"
 
 #define MINER_IDENTIFIER "gd:facebook:miner:9972c7ff-a30f-4dd4-bc77-1adf9dd14364"
 
+/* the updated time and photo count of every album seen so far are
+ * kept in the account state under this prefix
+ */
+#define STATE_ALBUM_PREFIX "album-"
+
+/* state key prefix for the cursor after the last photo page of an
+ * album that was stored
+ */
+#define STATE_CURSOR_PREFIX "cursor-"
+
+/* number of photos requested per page */
+#define PHOTOS_PAGE_SIZE 100
+
+/* number of albums whose photos are being listed at the same time;
+ * can be overridden with FACEBOOK_MINER_MAX_LISTINGS
+ */
+#define DEFAULT_MAX_LISTINGS 4
+
+/* number of photo pages that can be waiting to be written before the
+ * listings stop fetching more
+ */
+#define MAX_QUEUED_PAGES 8
+
+/* how long before the access token expires it is refreshed, and how
+ * long a token is assumed to last when GOA does not say
+ */
+#define TOKEN_REFRESH_MARGIN 300 /* seconds */
+#define DEFAULT_TOKEN_LIFETIME 3600 /* seconds */
+
+#define CACHED_AUTHORIZER_KEY "gom-cached-authorizer"
+
 G_DEFINE_TYPE (GomFacebookMiner, gom_facebook_miner, GOM_TYPE_MINER)
 
+/* authorizers are kept by GomMiner across refreshes, so that the access
+ * token is only fetched again when it is about to expire, and then in
+ * the background; this is attached to the authorizer
+ */
+typedef struct {
+  GFBGraphAuthorizer *authorizer; /* owns this */
+  GoaObject *object;
+  GSource *refresh_source;
+
+  /* held while refreshing */
+  GMutex lock;
+  gint64 expires_at; /* monotonic time, 0 if never authorized */
+} CachedAuthorizer;
+
+static void cached_authorizer_schedule_refresh (CachedAuthorizer *cached,
+                                                gint expires_in);
+
+static CachedAuthorizer *
+cached_authorizer_new (GFBGraphAuthorizer *authorizer,
+                       GoaObject *object)
+{
+  CachedAuthorizer *cached;
+
+  cached = g_slice_new0 (CachedAuthorizer);
+  cached->authorizer = authorizer;
+  cached->object = g_object_ref (object);
+  g_mutex_init (&cached->lock);
+
+  return cached;
+}
+
+static void
+cached_authorizer_free (CachedAuthorizer *cached)
+{
+  if (cached->refresh_source != NULL)
+    {
+      g_source_destroy (cached->refresh_source);
+      g_source_unref (cached->refresh_source);
+    }
+
+  g_object_unref (cached->object);
+  g_mutex_clear (&cached->lock);
+  g_slice_free (CachedAuthorizer, cached);
+}
+
+/* called with the lock held */
+static gboolean
+cached_authorizer_refresh (CachedAuthorizer *cached,
+                           GCancellable *cancellable,
+                           GError **error)
+{
+  GoaOAuth2Based *oauth2;
+  gint expires_in = 0;
+  gboolean retval = FALSE;
+
+  /* gfbgraph does not say when the token it got expires, so ask GOA,
+   * which hands out the same token
+   */
+  oauth2 = goa_object_get_oauth2_based (cached->object);
+  if (oauth2 == NULL)
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED,
+                   "Account does not support OAuth2");
+      goto out;
+    }
+
+  if (!goa_oauth2_based_call_get_access_token_sync (oauth2, NULL, &expires_in, cancellable, error))
+    goto out;
+
+  if (!gfbgraph_authorizer_refresh_authorization (cached->authorizer, cancellable, error))
+    goto out;
+
+  if (expires_in <= 0)
+    expires_in = DEFAULT_TOKEN_LIFETIME;
+
+  cached->expires_at = g_get_monotonic_time () + (gint64) expires_in * G_USEC_PER_SEC;
+  cached_authorizer_schedule_refresh (cached, expires_in);
+  retval = TRUE;
+
+ out:
+  g_clear_object (&oauth2);
+  return retval;
+}
+
+static gboolean
+cached_authorizer_ensure (CachedAuthorizer *cached,
+                          GCancellable *cancellable,
+                          GError **error)
+{
+  gboolean retval = TRUE;
+
+  g_mutex_lock (&cached->lock);
+
+  if (g_get_monotonic_time () >= cached->expires_at - TOKEN_REFRESH_MARGIN * G_USEC_PER_SEC)
+    retval = cached_authorizer_refresh (cached, cancellable, error);
+
+  g_mutex_unlock (&cached->lock);
+
+  return retval;
+}
+
+static gboolean
+cached_authorizer_refresh_job (GIOSchedulerJob *sched_job,
+                               GCancellable *cancellable,
+                               gpointer user_data)
+{
+  CachedAuthorizer *cached;
+  GError *error = NULL;
+
+  cached = g_object_get_data (G_OBJECT (user_data), CACHED_AUTHORIZER_KEY);
+  cached_authorizer_ensure (cached, cancellable, &error);
+
+  if (error != NULL)
+    {
+      g_warning ("Error refreshing authorization (%d): %s", error->code, error->message);
+      g_error_free (error);
+    }
+
+  return FALSE;
+}
+
+static gboolean
+cached_authorizer_refresh_timeout (gpointer user_data)
+{
+  CachedAuthorizer *cached = user_data;
+
+  g_io_scheduler_push_job (cached_authorizer_refresh_job,
+                           g_object_ref (cached->authorizer), g_object_unref,
+                           G_PRIORITY_DEFAULT, NULL);
+
+  return FALSE;
+}
+
+/* called with the lock held, from any thread */
+static void
+cached_authorizer_schedule_refresh (CachedAuthorizer *cached,
+                                    gint expires_in)
+{
+  if (cached->refresh_source != NULL)
+    {
+      g_source_destroy (cached->refresh_source);
+      g_source_unref (cached->refresh_source);
+    }
+
+  cached->refresh_source = g_timeout_source_new_seconds (MAX (expires_in - TOKEN_REFRESH_MARGIN, 1));
+  g_source_set_callback (cached->refresh_source,
+                         cached_authorizer_refresh_timeout,
+                         cached, NULL);
+  g_source_attach (cached->refresh_source, NULL);
+}
+
 static gboolean
 account_miner_job_process_photo (GomAccountMinerJob *job,
                                  GFBGraphPhoto *photo,
@@ -40,7 +227,7 @@ account_miner_job_process_photo (GomAccountMinerJob *job,
                                  const gchar *creator,
                                  GError **error)
 {
-  GTimeVal new_mtime;
+  gint64 new_mtime;
   const gchar *photo_id;
   const gchar *photo_name;
   const gchar *photo_created_time;
@@ -62,7 +249,7 @@ account_miner_job_process_photo (GomAccountMinerJob *job,
   identifier = g_strdup_printf ("facebook:%s", photo_id);
 
   /* remove from the list of the previous resources */
-  g_hash_table_remove (job->previous_resources, identifier);
+  gom_account_miner_job_mark_processed (job, identifier);
 
   resource = gom_tracker_sparql_connection_ensure_resource
     (job->connection,
@@ -81,12 +268,12 @@ account_miner_job_process_photo (GomAccountMinerJob *job,
     goto out;
 
   photo_updated_time = gfbgraph_node_get_updated_time (GFBGRAPH_NODE (photo));
-  if (!g_time_val_from_iso8601 (photo_updated_time, &new_mtime))
-    g_warning ("Can't convert updated time from ISO 8601 (%s) to a GTimeVal struct",
+  if (!gom_iso8601_parse (photo_updated_time, &new_mtime))
+    g_warning ("Can't convert updated time from ISO 8601 (%s) to a timestamp",
                photo_updated_time);
   else
     {
-      mtime_changed = gom_tracker_update_mtime (job->connection, new_mtime.tv_sec,
+      mtime_changed = gom_tracker_update_mtime (job->connection, new_mtime,
                                                 resource_exists, identifier, resource,
                                                 job->cancellable, error);
       if (*error != NULL)
@@ -173,27 +360,358 @@ account_miner_job_process_photo (GomAccountMinerJob *job,
   return TRUE;
 }
 
+static void
+account_miner_job_process_photo_node (GomAccountMinerJob *job,
+                                      JsonNode *node,
+                                      const gchar *parent_resource_urn,
+                                      const gchar *creator)
+{
+  GError *error = NULL;
+  GFBGraphPhoto *photo;
+
+  photo = GFBGRAPH_PHOTO (json_gobject_deserialize (GFBGRAPH_TYPE_PHOTO, node));
+  account_miner_job_process_photo (job, photo, parent_resource_urn, creator, &error);
+
+  if (error != NULL)
+    {
+      const gchar *photo_id;
+
+      photo_id = gfbgraph_node_get_id (GFBGRAPH_NODE (photo));
+      g_warning ("Unable to process %s: %s", photo_id, error->message);
+      g_error_free (error);
+    }
+
+  g_object_unref (photo);
+}
+
+/* photo pages are fetched on a pool of threads, and handed back to
+ * the job's thread, which does all the writing
+ */
+typedef struct {
+  GomAccountMinerJob *job;
+  const gchar *creator;
+  GHashTable *kept_albums;
+  GAsyncQueue *pages;
+  GThreadPool *pool;
+  guint n_albums;
+
+  /* pages fetched but not written yet */
+  GCond queued_cond;
+  GMutex queued_lock;
+  guint n_queued;
+} QueryData;
+
+typedef struct {
+  QueryData *data;
+  gchar *album_id;
+  gchar *resource;
+  gchar *stamp;
+  gchar *after;
+  gboolean resumed;
+} AlbumOp;
+
+typedef struct {
+  AlbumOp *op;
+  JsonParser *parser;
+  gchar *after;
+  GError *error;
+  gboolean last;
+} PhotoPage;
+
+static void
+album_op_free (AlbumOp *op)
+{
+  g_free (op->album_id);
+  g_free (op->resource);
+  g_free (op->stamp);
+  g_free (op->after);
+  g_slice_free (AlbumOp, op);
+}
+
+static void
+photo_page_free (PhotoPage *page)
+{
+  g_clear_object (&page->parser);
+  g_clear_error (&page->error);
+  g_free (page->after);
+  g_slice_free (PhotoPage, page);
+}
+
+static JsonObject *
+photo_page_get_object (PhotoPage *page)
+{
+  JsonNode *root;
+
+  root = json_parser_get_root (page->parser);
+  if (root == NULL || !JSON_NODE_HOLDS_OBJECT (root))
+    return NULL;
+
+  return json_node_get_object (root);
+}
+
+/* without a link to the next page, this is the last one */
+static gchar *
+photo_page_get_next_cursor (JsonObject *object)
+{
+  JsonObject *cursors;
+  JsonObject *paging;
+
+  if (!json_object_has_member (object, "paging"))
+    return NULL;
+
+  paging = json_object_get_object_member (object, "paging");
+  if (!json_object_has_member (paging, "next")
+      || !json_object_has_member (paging, "cursors"))
+    return NULL;
+
+  cursors = json_object_get_object_member (paging, "cursors");
+  if (!json_object_has_member (cursors, "after"))
+    return NULL;
+
+  return g_strdup (json_object_get_string_member (cursors, "after"));
+}
+
+static PhotoPage *
+album_op_fetch_page (AlbumOp *op,
+                     const gchar *after)
+{
+  GomAccountMinerJob *job = op->data->job;
+  JsonObject *object;
+  PhotoPage *page;
+  RestProxyCall *call;
+  gchar *function;
+  gchar *limit;
+
+  page = g_slice_new0 (PhotoPage);
+  page->op = op;
+  page->parser = json_parser_new ();
+
+  if (g_cancellable_set_error_if_cancelled (job->cancellable, &page->error))
+    goto out;
+
+  function = g_strconcat (op->album_id, "/photos", NULL);
+  limit = g_strdup_printf ("%u", PHOTOS_PAGE_SIZE);
+
+  call = gfbgraph_new_rest_call (GFBGRAPH_AUTHORIZER (job->service));
+  rest_proxy_call_set_function (call, function);
+  rest_proxy_call_add_param (call, "limit", limit);
+
+  if (after != NULL)
+    rest_proxy_call_add_param (call, "after", after);
+
+  if (rest_proxy_call_sync (call, &page->error))
+    json_parser_load_from_data (page->parser,
+                                rest_proxy_call_get_payload (call),
+                                rest_proxy_call_get_payload_length (call),
+                                &page->error);
+
+  g_object_unref (call);
+  g_free (function);
+  g_free (limit);
+
+  if (page->error != NULL)
+    goto out;
+
+  object = photo_page_get_object (page);
+  if (object == NULL)
+    {
+      g_set_error (&page->error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                   "Unexpected reply listing the photos of album %s", op->album_id);
+      goto out;
+    }
+
+  page->after = photo_page_get_next_cursor (object);
+
+ out:
+  page->last = (page->error != NULL || page->after == NULL);
+  return page;
+}
+
+/* runs on the pool; lists the photos of an album a page at a time,
+ * following the "after" cursors, so that only a few pages are held
+ * in memory and an interrupted listing resumes where it stopped
+ */
+static void
+album_op_list (gpointer op_data,
+               gpointer user_data)
+{
+  AlbumOp *op = op_data;
+  QueryData *data = user_data;
+  PhotoPage *page;
+  gboolean last;
+  gchar *after;
+
+  after = g_strdup (op->after);
+
+  do
+    {
+      page = album_op_fetch_page (op, after);
+
+      /* the page belongs to the writer once it is queued */
+      g_free (after);
+      after = g_strdup (page->after);
+      last = page->last;
+
+      /* do not get too far ahead of the writer */
+      g_mutex_lock (&data->queued_lock);
+      while (data->n_queued >= MAX_QUEUED_PAGES)
+        g_cond_wait (&data->queued_cond, &data->queued_lock);
+      data->n_queued++;
+      g_mutex_unlock (&data->queued_lock);
+
+      g_async_queue_push (data->pages, page);
+    }
+  while (!last);
+
+  g_free (after);
+}
+
+/* the last page of an album is also the last thing that refers to
+ * it, so the album goes away with it
+ */
+static void
+query_data_write_page (QueryData *data,
+                       PhotoPage *page)
+{
+  AlbumOp *op = page->op;
+  GomAccountMinerJob *job = data->job;
+  JsonArray *photos;
+  JsonObject *object;
+  gchar *cursor_key;
+  guint idx;
+
+  g_mutex_lock (&data->queued_lock);
+  data->n_queued--;
+  g_cond_signal (&data->queued_cond);
+  g_mutex_unlock (&data->queued_lock);
+
+  if (page->error != NULL)
+    {
+      if (!g_error_matches (page->error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        g_warning ("Unable to list the photos of %s: %s", op->album_id, page->error->message);
+
+      goto out;
+    }
+
+  object = photo_page_get_object (page);
+
+  if (json_object_has_member (object, "data"))
+    {
+      photos = json_object_get_array_member (object, "data");
+
+      for (idx = 0; idx < json_array_get_length (photos); idx++)
+        account_miner_job_process_photo_node (job,
+                                              json_array_get_element (photos, idx),
+                                              op->resource,
+                                              data->creator);
+    }
+
+  cursor_key = g_strconcat (STATE_CURSOR_PREFIX, op->album_id, NULL);
+  gom_account_miner_job_set_state (job, cursor_key, page->after);
+  g_free (cursor_key);
+
+  /* only remember the album once all its photos are in; a resumed
+   * listing did not see those before the cursor, so the next run
+   * lists the album completely
+   */
+  if (page->last)
+    {
+      gchar *stamp_key;
+
+      stamp_key = g_strconcat (STATE_ALBUM_PREFIX, op->album_id, NULL);
+      gom_account_miner_job_set_state (job, stamp_key, op->resumed ? NULL : op->stamp);
+      g_free (stamp_key);
+    }
+
+  gom_account_miner_job_save_state (job);
+
+ out:
+  if (page->last)
+    {
+      data->n_albums--;
+      album_op_free (op);
+    }
+
+  photo_page_free (page);
+}
+
+static void
+query_data_write_pages (QueryData *data,
+                        gboolean wait)
+{
+  PhotoPage *page;
+
+  while (data->n_albums > 0)
+    {
+      if (wait)
+        page = g_async_queue_pop (data->pages);
+      else
+        page = g_async_queue_try_pop (data->pages);
+
+      if (page == NULL)
+        break;
+
+      query_data_write_page (data, page);
+    }
+}
+
+static void
+query_data_list_photos (QueryData *data,
+                        const gchar *album_id,
+                        const gchar *album_resource,
+                        const gchar *stamp)
+{
+  GomAccountMinerJob *job = data->job;
+  AlbumOp *op;
+  gchar *cursor_key;
+
+  op = g_slice_new0 (AlbumOp);
+  op->data = data;
+  op->album_id = g_strdup (album_id);
+  op->resource = g_strdup (album_resource);
+  op->stamp = g_strdup (stamp);
+
+  cursor_key = g_strconcat (STATE_CURSOR_PREFIX, album_id, NULL);
+  op->after = gom_account_miner_job_get_state (job, cursor_key);
+  g_free (cursor_key);
+
+  /* the photos before the cursor are not listed again; the next
+   * complete listing takes care of any changes among them
+   */
+  op->resumed = (op->after != NULL);
+  if (op->resumed)
+    {
+      g_hash_table_add (data->kept_albums, g_strdup (album_resource));
+      g_debug ("Resuming the photos of album %s", album_id);
+    }
+
+  data->n_albums++;
+  g_thread_pool_push (data->pool, op, NULL);
+}
+
 /* TODO: Until GFBGraph parse the "from" node section, we require the
  *  album creator (generally the logged user)
  */
 static gboolean
-account_miner_job_process_album (GomAccountMinerJob *job,
+account_miner_job_process_album (QueryData *data,
                                  GFBGraphAlbum *album,
-                                 const gchar *creator,
                                  GError **error)
 {
+  GomAccountMinerJob *job = data->job;
   const gchar *album_id;
   const gchar *album_name;
   const gchar *album_description;
   const gchar *album_link;
   const gchar *album_created_time;
+  const gchar *album_updated_time;
   gchar *identifier;
   const gchar *class = "nfo:DataContainer";
   gchar *resource = NULL;
   gboolean resource_exists;
   gchar *contact_resource;
-  GList *l;
-  GList *photos = NULL;
+  gchar *old_stamp = NULL;
+  gchar *stamp = NULL;
+  gchar *stamp_key = NULL;
 
   album_id = gfbgraph_node_get_id (GFBGRAPH_NODE (album));
   album_link = gfbgraph_node_get_link (GFBGRAPH_NODE (album));
@@ -205,7 +723,7 @@ account_miner_job_process_album (GomAccountMinerJob *job,
   identifier = g_strdup_printf ("photos:collection:facebook:%s", album_id);
 
   /* remove from the list of the previous resources */
-  g_hash_table_remove (job->previous_resources, identifier);
+  gom_account_miner_job_mark_processed (job, identifier);
 
   resource = gom_tracker_sparql_connection_ensure_resource
     (job->connection,
@@ -225,9 +743,21 @@ account_miner_job_process_album (GomAccountMinerJob *job,
   if (*error != NULL)
     goto out;
 
-  /* TODO: Check updated time to avoid updating the album if has not
-   * been modified since our last run
+  /* adding or removing photos bumps the updated time, but the count
+   * is checked as well in case it does not
    */
+  stamp_key = g_strconcat (STATE_ALBUM_PREFIX, album_id, NULL);
+  album_updated_time = gfbgraph_node_get_updated_time (GFBGRAPH_NODE (album));
+  if (album_updated_time != NULL)
+    stamp = g_strdup_printf ("%s %u", album_updated_time, gfbgraph_album_get_count (album));
+
+  old_stamp = gom_account_miner_job_get_state (job, stamp_key);
+  if (resource_exists && stamp != NULL && g_strcmp0 (old_stamp, stamp) == 0)
+    {
+      g_hash_table_add (data->kept_albums, resource);
+      resource = NULL;
+      goto out;
+    }
 
   gom_tracker_sparql_connection_insert_or_replace_triple
     (job->connection,
@@ -259,7 +789,7 @@ account_miner_job_process_album (GomAccountMinerJob *job,
   contact_resource = gom_tracker_utils_ensure_contact_resource
     (job->connection,
      job->cancellable, error,
-     job->datasource_urn, creator);
+     job->datasource_urn, data->creator);
 
   if (*error != NULL)
     goto out;
@@ -283,35 +813,14 @@ account_miner_job_process_album (GomAccountMinerJob *job,
   if (*error != NULL)
     goto out;
 
-  /* Album photos */
-  photos = gfbgraph_node_get_connection_nodes (GFBGRAPH_NODE (album),
-                                               GFBGRAPH_TYPE_PHOTO,
-                                               GFBGRAPH_AUTHORIZER (job->service),
-                                               error);
-  if (*error != NULL)
-    goto out;
-
-  for (l = photos; l != NULL; l = l->next)
-    {
-      GError *local_error = NULL;
-      GFBGraphPhoto *photo = GFBGRAPH_PHOTO (l->data);
-
-      account_miner_job_process_photo (job, photo, resource, creator, &local_error);
-      if (local_error != NULL)
-        {
-          const gchar *photo_id;
-
-          photo_id = gfbgraph_node_get_id (GFBGRAPH_NODE (photo));
-          g_warning ("Unable to process %s: %s", photo_id, local_error->message);
-          g_clear_error (&local_error);
-        }
-    }
+  query_data_list_photos (data, album_id, resource, stamp);
 
  out:
   g_free (resource);
   g_free (identifier);
-
-  g_list_free_full (photos, g_object_unref);
+  g_free (old_stamp);
+  g_free (stamp);
+  g_free (stamp_key);
 
   if (*error != NULL)
     return FALSE;
@@ -319,31 +828,96 @@ account_miner_job_process_album (GomAccountMinerJob *job,
   return TRUE;
 }
 
+/* the photos of the albums that were skipped, or only partly listed,
+ * are still there, so keep them out of the cleanup
+ */
+static void
+account_miner_job_keep_album_photos (GomAccountMinerJob *job,
+                                     GHashTable *kept_albums,
+                                     GError **error)
+{
+  TrackerSparqlCursor *cursor = NULL;
+  gchar *select;
+
+  if (g_hash_table_size (kept_albums) == 0)
+    return;
+
+  select = g_strdup_printf ("SELECT nao:identifier(?photo) ?album "
+                            "WHERE { ?photo nie:dataSource <%s> ; nie:isPartOf ?album }",
+                            job->datasource_urn);
+
+  cursor = tracker_sparql_connection_query (job->connection,
+                                            select,
+                                            job->cancellable,
+                                            error);
+  g_free (select);
+
+  if (cursor == NULL)
+    goto out;
+
+  while (tracker_sparql_cursor_next (cursor, job->cancellable, error))
+    {
+      const gchar *album;
+
+      album = tracker_sparql_cursor_get_string (cursor, 1, NULL);
+      if (g_hash_table_contains (kept_albums, album))
+        gom_account_miner_job_mark_kept (job, tracker_sparql_cursor_get_string (cursor, 0, NULL));
+    }
+
+ out:
+  g_clear_object (&cursor);
+}
+
 static void
 query_facebook (GomAccountMinerJob *job,
                 GError **error)
 {
-  GFBGraphUser *me;
-  const gchar *me_name;
+  CachedAuthorizer *cached;
+  GFBGraphUser *me = NULL;
+  const gchar *max_listings_str;
   GList *albums = NULL;
   GList *l = NULL;
   GError *local_error = NULL;
+  QueryData data;
+  guint max_listings = DEFAULT_MAX_LISTINGS;
+
+  memset (&data, 0, sizeof (QueryData));
+  data.job = job;
+  data.kept_albums = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  data.pages = g_async_queue_new ();
+  g_cond_init (&data.queued_cond);
+  g_mutex_init (&data.queued_lock);
+
+  /* the authorizer is only refreshed here, off the main thread, if
+   * the background refresh has not kept it valid
+   */
+  cached = g_object_get_data (job->service, CACHED_AUTHORIZER_KEY);
+  if (!cached_authorizer_ensure (cached, job->cancellable, &local_error))
+    goto out;
 
   me = gfbgraph_user_get_me (GFBGRAPH_AUTHORIZER (job->service), &local_error);
   if (local_error != NULL)
     goto out;
 
-  me_name = gfbgraph_user_get_name (me);
+  data.creator = gfbgraph_user_get_name (me);
 
   albums = gfbgraph_user_get_albums (me, GFBGRAPH_AUTHORIZER (job->service), &local_error);
   if (local_error != NULL)
     goto out;
 
+  max_listings_str = g_getenv ("FACEBOOK_MINER_MAX_LISTINGS");
+  if (max_listings_str != NULL)
+    max_listings = MAX (1, g_ascii_strtoull (max_listings_str, NULL, 10));
+
+  data.pool = g_thread_pool_new (album_op_list, &data, max_listings, FALSE, &local_error);
+  if (local_error != NULL)
+    goto out;
+
   for (l = albums; l != NULL; l = l->next)
     {
       GFBGraphAlbum *album = GFBGRAPH_ALBUM (l->data);
 
-      account_miner_job_process_album (job, album, me_name, &local_error);
+      account_miner_job_process_album (&data, album, &local_error);
       if (local_error != NULL)
         {
           const gchar *album_id;
@@ -352,12 +926,26 @@ query_facebook (GomAccountMinerJob *job,
           g_warning ("Unable to process %s: %s", album_id, local_error->message);
           g_clear_error (&local_error);
         }
+
+      /* write whatever has come in while this album was stored */
+      query_data_write_pages (&data, FALSE);
     }
 
+  query_data_write_pages (&data, TRUE);
+
+  account_miner_job_keep_album_photos (job, data.kept_albums, &local_error);
+
  out:
   if (local_error != NULL)
     g_propagate_error (error, local_error);
 
+  if (data.pool != NULL)
+    g_thread_pool_free (data.pool, FALSE, TRUE);
+
+  g_async_queue_unref (data.pages);
+  g_cond_clear (&data.queued_cond);
+  g_mutex_clear (&data.queued_lock);
+  g_hash_table_unref (data.kept_albums);
   g_list_free_full (albums, g_object_unref);
   g_clear_object (&me);
 }
@@ -367,16 +955,13 @@ create_service (GomMiner *self,
                 GoaObject *object)
 {
   GFBGraphGoaAuthorizer *authorizer;
-  GError *error = NULL;
+  CachedAuthorizer *cached;
 
+  /* the token is fetched by the first job, off the main thread */
   authorizer = gfbgraph_goa_authorizer_new (object);
-
-  gfbgraph_authorizer_refresh_authorization (GFBGRAPH_AUTHORIZER (authorizer), NULL, &error);
-  if (error != NULL)
-    {
-      g_warning ("Error refreshing authorization (%d): %s", error->code, error->message);
-      g_error_free (error);
-    }
+  cached = cached_authorizer_new (GFBGRAPH_AUTHORIZER (authorizer), object);
+  g_object_set_data_full (G_OBJECT (authorizer), CACHED_AUTHORIZER_KEY,
+                          cached, (GDestroyNotify) cached_authorizer_free);
 
   return G_OBJECT (authorizer);
 }
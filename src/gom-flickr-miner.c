@@ -22,6 +22,8 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include <goa/goa.h>
 #include <grilo.h>
 
@@ -30,10 +32,43 @@
 
 #define MINER_IDENTIFIER "gd:flickr:miner:3c63f509-23e8-4283-8aed-154bb55ef07b"
 
+/* maximum number of sets being browsed at the same time; can be
+ * overridden with FLICKR_MINER_MAX_BROWSES
+ */
+#define DEFAULT_MAX_BROWSES 4
+
+/* number of nie:isPartOf links written per SPARQL update */
+#define LINKS_PER_UPDATE 100
+
+/* number of photos requested per search operation */
+#define SEARCH_PAGE_SIZE 100
+
+/* state key holding where an interrupted search stopped: the offset
+ * of the first photo not yet stored, and the id of the one before it
+ */
+#define STATE_SEARCH_OFFSET "search-offset"
+
+/* how long a query waits for the plugin to add the account's source */
+#define SOURCE_TIMEOUT 10 /* seconds */
+
+#define SOURCE_ID_PREFIX "grl-flickr-"
+
 G_DEFINE_TYPE (GomFlickrMiner, gom_flickr_miner, GOM_TYPE_MINER)
 
+/* the metadata keys that account_miner_job_process_entry stores */
+static GList *media_keys = NULL;
+
 struct _GomFlickrMinerPrivate {
-  GQueue *boxes;
+  guint max_browses;
+
+  gboolean plugin_loaded;
+  gulong source_added_id;
+  gulong source_removed_id;
+
+  /* source id -> GrlSource, shared with the jobs' threads */
+  GCond sources_cond;
+  GMutex sources_lock;
+  GHashTable *sources;
 };
 
 typedef enum {
@@ -47,14 +82,34 @@ typedef struct {
 } FlickrEntry;
 
 typedef struct {
-  FlickrEntry *parent_entry;
   GMainLoop *loop;
   GomAccountMinerJob *job;
-  GrlSource *source;
-  const gchar *source_id;
-} SyncData;
+  GrlOperationOptions *opts;
+  const GList *keys;
+  GQueue *boxes;
+  guint n_browses;
+  guint max_browses;
 
-static void account_miner_job_browse_container (GomAccountMinerJob *job, FlickrEntry *entry);
+  GHashTable *photos;      /* photo id -> resource */
+  GHashTable *sets;        /* set id -> resource */
+  GHashTable *memberships; /* photo id -> GList of set ids */
+} QueryData;
+
+typedef struct {
+  QueryData *data;
+  FlickrEntry *entry;
+} BrowseOp;
+
+typedef struct {
+  guint operation_id;
+  guint offset;
+  GPtrArray *media;
+  GError *error;
+  gboolean done;
+} SearchPage;
+
+static void query_data_dispatch (QueryData *data);
+static GrlSource *gom_flickr_miner_wait_for_source (GomFlickrMiner *self, const gchar *source_id);
 
 static FlickrEntry *
 create_entry (GrlMedia *media, GrlMedia *parent)
@@ -93,25 +148,31 @@ get_grl_options (GrlSource *source)
   return opts;
 }
 
+static void
+memberships_free (gpointer data)
+{
+  g_list_free_full ((GList *) data, g_free);
+}
+
 static gboolean
 account_miner_job_process_entry (GomAccountMinerJob *job,
                                  OpType op_type,
                                  FlickrEntry *entry,
+                                 gchar **out_resource,
                                  GError **error)
 {
   GDateTime *created_time, *modification_date;
   gchar *contact_resource;
   gchar *mime;
   gchar *resource = NULL;
-  gchar *date, *identifier;
+  gchar date[GOM_ISO8601_SIZE];
+  gchar *identifier;
   const gchar *class = NULL, *id;
+  const gchar *mime_type;
   const gchar *url;
   gboolean resource_exists, mtime_changed;
   gint64 new_mtime;
 
-  if (op_type == OP_CREATE_HIEARCHY && entry->parent == NULL && !GRL_IS_MEDIA_BOX (entry->media))
-    return TRUE;
-
   id = grl_media_get_id (entry->media);
   identifier = g_strdup_printf ("%sflickr:%s",
                                 GRL_IS_MEDIA_BOX (entry->media) ?
@@ -119,7 +180,7 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
                                 id);
 
   /* remove from the list of the previous resources */
-  g_hash_table_remove (job->previous_resources, identifier);
+  gom_account_miner_job_mark_processed (job, identifier);
 
   if (GRL_IS_MEDIA_BOX (entry->media))
     class = "nfo:DataContainer";
@@ -204,13 +265,12 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
   /* the resource changed - just set all the properties again */
   if (created_time != NULL)
     {
-      date = gom_iso8601_from_timestamp (g_date_time_to_unix (created_time));
+      gom_iso8601_format (g_date_time_to_unix (created_time), date);
       gom_tracker_sparql_connection_insert_or_replace_triple
         (job->connection,
          job->cancellable, error,
          job->datasource_urn, resource,
          "nie:contentCreated", date);
-      g_free (date);
     }
 
   if (*error != NULL)
@@ -235,7 +295,12 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
   if (*error != NULL)
     goto out;
 
-  mime = g_content_type_guess (url, NULL, 0, NULL);
+  /* Flickr serves JPEG, PNG and GIF, which the table knows */
+  if (url != NULL && gom_filename_lookup_type (url, NULL, &mime_type))
+    mime = g_strdup (mime_type);
+  else
+    mime = g_content_type_guess (url, NULL, 0, NULL);
+
   if (mime != NULL)
     {
       gom_tracker_sparql_connection_insert_or_replace_triple
@@ -268,7 +333,11 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
     goto out;
 
  out:
-  g_free (resource);
+  if (*error == NULL && out_resource != NULL)
+    *out_resource = resource;
+  else
+    g_free (resource);
+
   g_free (identifier);
 
   if (*error != NULL)
@@ -277,6 +346,23 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
   return TRUE;
 }
 
+static void
+query_data_add_membership (QueryData *data,
+                           const gchar *photo_id,
+                           const gchar *set_id)
+{
+  GList *set_ids;
+
+  set_ids = g_hash_table_lookup (data->memberships, photo_id);
+  if (set_ids == NULL)
+    g_hash_table_insert (data->memberships,
+                         g_strdup (photo_id),
+                         g_list_prepend (NULL, g_strdup (set_id)));
+  else
+    /* appending keeps the head of the list, so no need to re-insert it */
+    set_ids = g_list_append (set_ids, g_strdup (set_id));
+}
+
 static void
 source_browse_cb (GrlSource *source,
                   guint operation_id,
@@ -286,67 +372,90 @@ source_browse_cb (GrlSource *source,
                   const GError *error)
 {
   GError *local_error = NULL;
-  SyncData *data = (SyncData *) user_data;
-  GomFlickrMiner *self = GOM_FLICKR_MINER (data->job->miner);
+  BrowseOp *op = (BrowseOp *) user_data;
+  QueryData *data = op->data;
 
   if (error != NULL)
     {
       g_warning ("Unable to browse source %p: %s", source, error->message);
-      return;
+      goto out;
     }
 
-  if (media != NULL)
+  if (media == NULL)
+    goto out;
+
+  if (GRL_IS_MEDIA_BOX (media))
     {
       FlickrEntry *entry;
+      gchar *resource = NULL;
 
-      entry = create_entry (media, data->parent_entry->media);
-      account_miner_job_process_entry (data->job, OP_CREATE_HIEARCHY, entry, &local_error);
+      entry = create_entry (media, op->entry->media);
+      account_miner_job_process_entry (data->job, OP_CREATE_HIEARCHY, entry, &resource, &local_error);
       if (local_error != NULL)
         {
           g_warning ("Unable to process entry %p: %s", media, local_error->message);
           g_error_free (local_error);
         }
-
-      if (GRL_IS_MEDIA_BOX (media))
-        g_queue_push_tail (self->priv->boxes, entry);
       else
-        free_entry (entry);
+        {
+          g_hash_table_insert (data->sets, g_strdup (grl_media_get_id (media)), resource);
+        }
+
+      g_queue_push_tail (data->boxes, entry);
+    }
+  else if (op->entry->media != NULL)
+    {
+      /* the photo itself has already been stored by the search, so
+       * only remember which set it belongs to
+       */
+      query_data_add_membership (data,
+                                 grl_media_get_id (media),
+                                 grl_media_get_id (op->entry->media));
     }
 
+ out:
   if (remaining == 0)
-    g_main_loop_quit (data->loop);
+    {
+      free_entry (op->entry);
+      g_slice_free (BrowseOp, op);
+
+      data->n_browses--;
+      query_data_dispatch (data);
+    }
 }
 
 static void
-account_miner_job_browse_container (GomAccountMinerJob *job, FlickrEntry *entry)
+account_miner_job_browse_container (QueryData *data, FlickrEntry *entry)
 {
-  GMainContext *context;
-  GrlOperationOptions *opts;
-  const GList *keys;
-  SyncData data;
-
-  data.parent_entry = entry;
-  data.job = job;
-
-  context = g_main_context_new ();
-  g_main_context_push_thread_default (context);
-  data.loop = g_main_loop_new (context, FALSE);
+  BrowseOp *op;
 
-  keys = grl_source_supported_keys (GRL_SOURCE (data.job->service));
-  opts = get_grl_options (GRL_SOURCE (data.job->service));
+  op = g_slice_new0 (BrowseOp);
+  op->data = data;
+  op->entry = entry;
 
-  grl_source_browse (GRL_SOURCE (job->service),
+  data->n_browses++;
+  grl_source_browse (GRL_SOURCE (data->job->service),
                      entry->media,
-                     keys,
-                     opts,
+                     data->keys,
+                     data->opts,
                      source_browse_cb,
-                     &data);
-  g_main_loop_run (data.loop);
+                     op);
+}
 
-  g_object_unref (opts);
-  g_main_loop_unref (data.loop);
-  g_main_context_pop_thread_default (context);
-  g_main_context_unref (context);
+static void
+query_data_dispatch (QueryData *data)
+{
+  /* keep up to max_browses sets in flight on the shared context */
+  while (data->n_browses < data->max_browses && !g_queue_is_empty (data->boxes))
+    {
+      FlickrEntry *entry;
+
+      entry = (FlickrEntry *) g_queue_pop_head (data->boxes);
+      account_miner_job_browse_container (data, entry);
+    }
+
+  if (data->n_browses == 0)
+    g_main_loop_quit (data->loop);
 }
 
 static void
@@ -357,32 +466,301 @@ source_search_cb (GrlSource *source,
                   gpointer user_data,
                   const GError *error)
 {
-  GError *local_error = NULL;
-  SyncData *data = (SyncData *) user_data;
+  SearchPage *page = (SearchPage *) user_data;
 
+  /* only collect the results here; they are written once the whole
+   * page has arrived, while the next one is being fetched
+   */
   if (error != NULL)
+    page->error = g_error_copy (error);
+  else if (media != NULL)
+    g_ptr_array_add (page->media, media);
+
+  if (remaining == 0)
+    page->done = TRUE;
+}
+
+static SearchPage *
+search_page_new (QueryData *data,
+                 guint offset)
+{
+  GrlOperationOptions *opts;
+  SearchPage *page;
+
+  page = g_slice_new0 (SearchPage);
+  page->offset = offset;
+  page->media = g_ptr_array_new_with_free_func (g_object_unref);
+
+  opts = grl_operation_options_copy (data->opts);
+  grl_operation_options_set_skip (opts, offset);
+  grl_operation_options_set_count (opts, SEARCH_PAGE_SIZE);
+
+  page->operation_id = grl_source_search (GRL_SOURCE (data->job->service),
+                                          NULL,
+                                          data->keys,
+                                          opts,
+                                          source_search_cb,
+                                          page);
+  g_object_unref (opts);
+
+  return page;
+}
+
+static void
+search_page_free (SearchPage *page)
+{
+  g_ptr_array_unref (page->media);
+  g_clear_error (&page->error);
+  g_slice_free (SearchPage, page);
+}
+
+static void
+search_page_wait (SearchPage *page,
+                  GMainContext *context)
+{
+  while (!page->done)
+    g_main_context_iteration (context, TRUE);
+}
+
+static void
+account_miner_job_process_photo (QueryData *data,
+                                 GrlMedia *media)
+{
+  GError *local_error = NULL;
+  FlickrEntry *entry;
+  gchar *resource = NULL;
+
+  entry = create_entry (media, NULL);
+  account_miner_job_process_entry (data->job, OP_FETCH_ALL, entry, &resource, &local_error);
+  if (local_error != NULL)
+    {
+      g_warning ("Unable to process entry %p: %s", media, local_error->message);
+      g_error_free (local_error);
+    }
+  else
     {
-      g_warning ("Unable to search source %p: %s", source, error->message);
-      return;
+      g_hash_table_insert (data->photos, g_strdup (grl_media_get_id (media)), resource);
     }
 
-  if (media != NULL)
+  free_entry (entry);
+}
+
+static void
+account_miner_job_search_photos (QueryData *data,
+                                 GMainContext *context,
+                                 GError **error)
+{
+  GomAccountMinerJob *job = data->job;
+  SearchPage *page = NULL, *next = NULL;
+  gchar *anchor = NULL;
+  gchar *checkpoint;
+  guint offset = 0;
+  guint idx;
+
+  checkpoint = gom_account_miner_job_get_state (job, STATE_SEARCH_OFFSET);
+  if (checkpoint != NULL)
     {
-      FlickrEntry *entry;
+      gchar **fields;
 
-      entry = create_entry (media, NULL);
-      account_miner_job_process_entry (data->job, OP_FETCH_ALL, entry, &local_error);
-      if (local_error != NULL)
+      fields = g_strsplit (checkpoint, " ", 2);
+      if (fields[0] != NULL && fields[1] != NULL)
         {
-          g_warning ("Unable to process entry %p: %s", media, local_error->message);
-          g_error_free (local_error);
+          offset = (guint) g_ascii_strtoull (fields[0], NULL, 10);
+          anchor = g_strdup (fields[1]);
         }
 
-      free_entry (entry);
+      g_strfreev (fields);
+      g_free (checkpoint);
     }
 
-  if (remaining == 0)
-    g_main_loop_quit (data->loop);
+  if (anchor != NULL)
+    {
+      GHashTableIter iter;
+      GPtrArray *stored;
+      gpointer identifier, resource;
+
+      /* the photos before the checkpoint are not visited again, so
+       * keep them out of the cleanup, and remember them to link them
+       * to their sets; a later complete run takes care of any
+       * deletions among them
+       */
+      stored = g_ptr_array_new_with_free_func (g_free);
+
+      g_hash_table_iter_init (&iter, job->previous_resources);
+      while (g_hash_table_iter_next (&iter, &identifier, &resource))
+        {
+          if (!g_str_has_prefix (identifier, "flickr:"))
+            continue;
+
+          g_hash_table_insert (data->photos,
+                               g_strdup ((const gchar *) identifier + strlen ("flickr:")),
+                               g_strdup (resource));
+          g_ptr_array_add (stored, g_strdup (identifier));
+        }
+
+      for (idx = 0; idx < stored->len; idx++)
+        gom_account_miner_job_mark_kept (job, g_ptr_array_index (stored, idx));
+
+      g_ptr_array_unref (stored);
+
+      /* the photostream shifts as photos are uploaded and deleted, so
+       * start a page early and look for the last stored photo there
+       */
+      offset = (offset > SEARCH_PAGE_SIZE) ? offset - SEARCH_PAGE_SIZE : 0;
+      g_debug ("Resuming the search around photo %u", offset);
+    }
+
+ restart:
+  page = search_page_new (data, offset);
+
+  while (page != NULL)
+    {
+      GrlMedia *media = NULL;
+
+      search_page_wait (page, context);
+
+      if (page->error != NULL)
+        {
+          g_propagate_error (error, page->error);
+          page->error = NULL;
+          goto out;
+        }
+
+      /* an empty page marks the end of the photostream; otherwise
+       * prefetch the next page while writing this one
+       */
+      if (page->media->len > 0)
+        next = search_page_new (data, page->offset + page->media->len);
+
+      for (idx = 0; idx < page->media->len; idx++)
+        {
+          if (g_cancellable_set_error_if_cancelled (job->cancellable, error))
+            goto out;
+
+          media = g_ptr_array_index (page->media, idx);
+          account_miner_job_process_photo (data, media);
+
+          if (anchor != NULL && g_strcmp0 (grl_media_get_id (media), anchor) == 0)
+            g_clear_pointer (&anchor, g_free);
+
+          /* let the prefetch make progress */
+          while (g_main_context_iteration (context, FALSE));
+        }
+
+      /* until the last stored photo is found again, the old
+       * checkpoint is still the one to resume from
+       */
+      if (anchor == NULL && media != NULL)
+        {
+          checkpoint = g_strdup_printf ("%u %s",
+                                        page->offset + page->media->len,
+                                        grl_media_get_id (media));
+          gom_account_miner_job_set_state (job, STATE_SEARCH_OFFSET, checkpoint);
+          gom_account_miner_job_save_state (job);
+          g_free (checkpoint);
+        }
+
+      search_page_free (page);
+      page = next;
+      next = NULL;
+    }
+
+  /* the last stored photo is gone, or moved before where the search
+   * started; go through the whole photostream rather than miss the
+   * photos in between
+   */
+  if (anchor != NULL && offset > 0)
+    {
+      g_debug ("Unable to find where the search stopped, starting over");
+
+      g_clear_pointer (&anchor, g_free);
+      offset = 0;
+      goto restart;
+    }
+
+  gom_account_miner_job_set_state (job, STATE_SEARCH_OFFSET, NULL);
+
+ out:
+  if (next != NULL)
+    {
+      grl_operation_cancel (next->operation_id);
+      search_page_wait (next, context);
+      search_page_free (next);
+    }
+
+  if (page != NULL)
+    search_page_free (page);
+
+  g_free (anchor);
+}
+
+static void
+query_data_flush_links (QueryData *data,
+                        GString *insert,
+                        GError **error)
+{
+  if (insert->len == 0)
+    return;
+
+  g_string_append (insert, "}");
+  tracker_sparql_connection_update (data->job->connection,
+                                    insert->str,
+                                    G_PRIORITY_DEFAULT,
+                                    data->job->cancellable,
+                                    error);
+  g_string_truncate (insert, 0);
+}
+
+static void
+account_miner_job_link_photos (QueryData *data,
+                               GError **error)
+{
+  GHashTableIter iter;
+  GString *insert;
+  gpointer key, value;
+  guint n_links = 0;
+
+  insert = g_string_new (NULL);
+
+  g_hash_table_iter_init (&iter, data->memberships);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      const gchar *photo_resource;
+      GList *l;
+
+      photo_resource = g_hash_table_lookup (data->photos, key);
+      if (photo_resource == NULL)
+        continue;
+
+      for (l = value; l != NULL; l = l->next)
+        {
+          const gchar *set_resource;
+
+          set_resource = g_hash_table_lookup (data->sets, l->data);
+          if (set_resource == NULL)
+            continue;
+
+          if (insert->len == 0)
+            g_string_append_printf (insert, "INSERT OR REPLACE INTO <%s> { ",
+                                    data->job->datasource_urn);
+
+          g_string_append_printf (insert, "<%s> nie:isPartOf <%s> . ",
+                                  photo_resource, set_resource);
+          n_links++;
+
+          if (n_links % LINKS_PER_UPDATE == 0)
+            {
+              query_data_flush_links (data, insert, error);
+              if (*error != NULL)
+                goto out;
+            }
+        }
+    }
+
+  query_data_flush_links (data, insert, error);
+
+ out:
+  g_string_free (insert, TRUE);
 }
 
 static void
@@ -390,12 +768,17 @@ query_flickr (GomAccountMinerJob *job,
               GError **error)
 {
   GomFlickrMiner *self = GOM_FLICKR_MINER (job->miner);
-  GomFlickrMinerPrivate *priv = self->priv;
-  FlickrEntry *entry;
-  const GList *keys;
   GMainContext *context;
-  GrlOperationOptions *opts;
-  SyncData data;
+  QueryData data;
+
+  if (job->service == NULL)
+    {
+      gchar *source_id;
+
+      source_id = g_strconcat (SOURCE_ID_PREFIX, goa_account_get_id (job->account), NULL);
+      job->service = G_OBJECT (gom_flickr_miner_wait_for_source (self, source_id));
+      g_free (source_id);
+    }
 
   if (job->service == NULL)
   {
@@ -408,98 +791,194 @@ query_flickr (GomAccountMinerJob *job,
   }
 
   /* grl_source_browse does not fetch photos that are not part of a
-   * set. So, use grl_source_search to fetch all photos and then allot
-   * each photo to any set that it might be a part of.
+   * set. So, use grl_source_search to fetch and store all photos, then
+   * browse the sets only to find out which photos belong to them and
+   * link everything in one go at the end.
    */
 
-  data.job = job;
   context = g_main_context_new ();
   g_main_context_push_thread_default (context);
+
+  data.job = job;
   data.loop = g_main_loop_new (context, FALSE);
+  data.keys = media_keys;
+  data.opts = get_grl_options (GRL_SOURCE (job->service));
+  data.boxes = g_queue_new ();
+  data.n_browses = 0;
+  data.max_browses = self->priv->max_browses;
+  data.photos = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  data.sets = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  data.memberships = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, memberships_free);
+
+  account_miner_job_search_photos (&data, context, error);
+  if (*error != NULL)
+    goto out;
+
+  /* browse the sets concurrently on the same context, starting from
+   * the root container
+   */
+  g_queue_push_tail (data.boxes, create_entry (NULL, NULL));
+  query_data_dispatch (&data);
 
-  keys = grl_source_supported_keys (GRL_SOURCE(job->service));
-  opts = get_grl_options (GRL_SOURCE(job->service));
-  grl_source_search (GRL_SOURCE (job->service), NULL, keys, opts, source_search_cb, &data);
-  g_main_loop_run (data.loop);
+  if (data.n_browses > 0)
+    g_main_loop_run (data.loop);
 
-  g_object_unref (opts);
+  account_miner_job_link_photos (&data, error);
+
+ out:
+  g_hash_table_unref (data.memberships);
+  g_hash_table_unref (data.sets);
+  g_hash_table_unref (data.photos);
+  g_queue_free_full (data.boxes, (GDestroyNotify) free_entry);
+
+  g_object_unref (data.opts);
   g_main_loop_unref (data.loop);
   g_main_context_pop_thread_default (context);
   g_main_context_unref (context);
+}
 
-  entry = create_entry (NULL, NULL);
-  account_miner_job_browse_container (job, entry);
-  free_entry (entry);
+static void
+source_added_cb (GrlRegistry *registry, GrlSource *source, gpointer user_data)
+{
+  GomFlickrMiner *self = GOM_FLICKR_MINER (user_data);
+  const gchar *source_id;
+
+  source_id = grl_source_get_id (source);
+  if (!g_str_has_prefix (source_id, SOURCE_ID_PREFIX))
+    return;
 
-  while (!g_queue_is_empty (priv->boxes))
+  g_debug ("Source %s added", source_id);
+
+  g_mutex_lock (&self->priv->sources_lock);
+  g_hash_table_insert (self->priv->sources, g_strdup (source_id), g_object_ref (source));
+  g_cond_broadcast (&self->priv->sources_cond);
+  g_mutex_unlock (&self->priv->sources_lock);
+}
+
+static void
+source_removed_cb (GrlRegistry *registry, GrlSource *source, gpointer user_data)
+{
+  GomFlickrMiner *self = GOM_FLICKR_MINER (user_data);
+
+  g_mutex_lock (&self->priv->sources_lock);
+  g_hash_table_remove (self->priv->sources, grl_source_get_id (source));
+  g_mutex_unlock (&self->priv->sources_lock);
+}
+
+static void
+gom_flickr_miner_ensure_plugin (GomFlickrMiner *self)
+{
+  GrlRegistry *registry;
+  GError *error = NULL;
+
+  if (self->priv->plugin_loaded)
+    return;
+
+  self->priv->plugin_loaded = TRUE;
+
+  grl_init (NULL, NULL);
+  registry = grl_registry_get_default ();
+
+  /* the plugin adds one source per account as GOA reports them, so
+   * start listening before loading it
+   */
+  self->priv->source_added_id =
+    g_signal_connect (registry, "source-added", G_CALLBACK (source_added_cb), self);
+  self->priv->source_removed_id =
+    g_signal_connect (registry, "source-removed", G_CALLBACK (source_removed_cb), self);
+
+  if (!grl_registry_load_plugin_by_id (registry, "grl-flickr", &error))
     {
-      entry = (FlickrEntry *) g_queue_pop_head (priv->boxes);
-      account_miner_job_browse_container (job, entry);
-      free_entry (entry);
+      g_warning ("Unable to load the Flickr plugin: %s", error->message);
+      g_error_free (error);
     }
 }
 
-static void
-source_added_cb (GrlRegistry *registry, GrlSource *source, gpointer user_data)
+static GrlSource *
+gom_flickr_miner_wait_for_source (GomFlickrMiner *self,
+                                  const gchar *source_id)
 {
-  SyncData *data = (SyncData *) user_data;
-  gchar *source_id;
+  GrlSource *source;
+  gint64 end_time;
 
-  g_object_get (source, "source-id", &source_id, NULL);
-  if (g_strcmp0 (source_id, data->source_id) != 0)
-    goto out;
+  end_time = g_get_monotonic_time () + SOURCE_TIMEOUT * G_TIME_SPAN_SECOND;
 
-  data->source = g_object_ref (source);
-  g_main_loop_quit (data->loop);
+  g_mutex_lock (&self->priv->sources_lock);
 
- out:
-  g_free (source_id);
+  while ((source = g_hash_table_lookup (self->priv->sources, source_id)) == NULL)
+    {
+      if (!g_cond_wait_until (&self->priv->sources_cond, &self->priv->sources_lock, end_time))
+        break;
+    }
+
+  if (source != NULL)
+    g_object_ref (source);
+
+  g_mutex_unlock (&self->priv->sources_lock);
+
+  return source;
 }
 
 static GObject *
-create_service (GomMiner *self,
+create_service (GomMiner *miner,
                 GoaObject *object)
 {
+  GomFlickrMiner *self = GOM_FLICKR_MINER (miner);
   GoaAccount *acc;
-  GrlRegistry *registry;
-  GrlSource *source = NULL;
-  gchar *source_id = NULL;
+  GrlSource *source;
+  gchar *source_id;
 
   acc = goa_object_peek_account (object);
   if (acc == NULL)
     return NULL;
 
-  source_id = g_strdup_printf ("grl-flickr-%s", goa_account_get_id (acc));
+  gom_flickr_miner_ensure_plugin (self);
 
-  registry = grl_registry_get_default ();
+  source_id = g_strconcat (SOURCE_ID_PREFIX, goa_account_get_id (acc), NULL);
 
-  g_debug ("Looking for source %s", source_id);
-  source = grl_registry_lookup_source (registry, source_id);
-  if (source == NULL)
-    {
-      GMainContext *context;
-      SyncData data;
+  /* do not wait for the source here; if the plugin has not added it
+   * yet, query_flickr waits for it off the main thread
+   */
+  g_mutex_lock (&self->priv->sources_lock);
+  source = g_hash_table_lookup (self->priv->sources, source_id);
+  if (source != NULL)
+    g_object_ref (source);
+  g_mutex_unlock (&self->priv->sources_lock);
 
-      context = g_main_context_get_thread_default ();
-      data.loop = g_main_loop_new (context, FALSE);
-      data.source_id = source_id;
+  g_free (source_id);
 
-      g_signal_connect (registry, "source-added", G_CALLBACK (source_added_cb), &data);
-      g_main_loop_run (data.loop);
-      g_main_loop_unref (data.loop);
+  /* freeing job calls unref upon this object */
+  return G_OBJECT (source);
+}
 
-      /* we steal the ref from data */
-      source = data.source;
-    }
-  else
+static void
+gom_flickr_miner_dispose (GObject *object)
+{
+  GomFlickrMiner *self = GOM_FLICKR_MINER (object);
+  GrlRegistry *registry;
+
+  if (self->priv->plugin_loaded)
     {
-      /* freeing job calls unref upon this object */
-      g_object_ref (source);
+      registry = grl_registry_get_default ();
+
+      if (self->priv->source_added_id != 0)
+        {
+          g_signal_handler_disconnect (registry, self->priv->source_added_id);
+          self->priv->source_added_id = 0;
+        }
+
+      if (self->priv->source_removed_id != 0)
+        {
+          g_signal_handler_disconnect (registry, self->priv->source_removed_id);
+          self->priv->source_removed_id = 0;
+        }
     }
 
-  g_free (source_id);
+  g_mutex_lock (&self->priv->sources_lock);
+  g_hash_table_remove_all (self->priv->sources);
+  g_mutex_unlock (&self->priv->sources_lock);
 
-  return G_OBJECT (source);
+  G_OBJECT_CLASS (gom_flickr_miner_parent_class)->dispose (object);
 }
 
 static void
@@ -507,7 +986,9 @@ gom_flickr_miner_finalize (GObject *object)
 {
   GomFlickrMiner *self = GOM_FLICKR_MINER (object);
 
-  g_queue_free_full (self->priv->boxes, (GDestroyNotify) free_entry);
+  g_hash_table_unref (self->priv->sources);
+  g_mutex_clear (&self->priv->sources_lock);
+  g_cond_clear (&self->priv->sources_cond);
 
   G_OBJECT_CLASS (gom_flickr_miner_parent_class)->finalize (object);
 }
@@ -515,8 +996,18 @@ gom_flickr_miner_finalize (GObject *object)
 static void
 gom_flickr_miner_init (GomFlickrMiner *self)
 {
+  const gchar *max_browses;
+
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, GOM_TYPE_FLICKR_MINER, GomFlickrMinerPrivate);
-  self->priv->boxes = g_queue_new ();
+  self->priv->max_browses = DEFAULT_MAX_BROWSES;
+
+  g_mutex_init (&self->priv->sources_lock);
+  g_cond_init (&self->priv->sources_cond);
+  self->priv->sources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+
+  max_browses = g_getenv ("FLICKR_MINER_MAX_BROWSES");
+  if (max_browses != NULL)
+    self->priv->max_browses = MAX (1, g_ascii_strtoull (max_browses, NULL, 10));
 }
 
 static void
@@ -524,9 +1015,8 @@ gom_flickr_miner_class_init (GomFlickrMinerClass *klass)
 {
   GObjectClass *oclass = G_OBJECT_CLASS (klass);
   GomMinerClass *miner_class = GOM_MINER_CLASS (klass);
-  GrlRegistry *registry;
-  GError *error = NULL;
 
+  oclass->dispose = gom_flickr_miner_dispose;
   oclass->finalize = gom_flickr_miner_finalize;
 
   miner_class->goa_provider_type = "flickr";
@@ -536,14 +1026,16 @@ gom_flickr_miner_class_init (GomFlickrMinerClass *klass)
   miner_class->create_service = create_service;
   miner_class->query = query_flickr;
 
-  grl_init (NULL, NULL);
-  registry = grl_registry_get_default ();
-
-  if (!grl_registry_load_plugin_by_id (registry, "grl-flickr", &error))
-    {
-      g_error ("%s", error->message);
-      g_error_free (error);
-    }
+  /* Grilo itself and the plugin are only loaded when the first
+   * account is set up, see gom_flickr_miner_ensure_plugin
+   */
+  media_keys = grl_metadata_key_list_new (GRL_METADATA_KEY_ID,
+                                          GRL_METADATA_KEY_TITLE,
+                                          GRL_METADATA_KEY_URL,
+                                          GRL_METADATA_KEY_DESCRIPTION,
+                                          GRL_METADATA_KEY_AUTHOR,
+                                          GRL_METADATA_KEY_CREATION_DATE,
+                                          GRL_METADATA_KEY_INVALID);
 
   g_type_class_add_private (klass, sizeof (GomFlickrMinerPrivate));
 }
@@ -41,7 +41,8 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
 {
   GDataEntry *entry = GDATA_ENTRY (doc_entry);
   gchar *resource = NULL;
-  gchar *date, *identifier;
+  gchar date[GOM_ISO8601_SIZE];
+  gchar *identifier;
   const gchar *class = NULL;
   const gchar *mimetype_override = NULL;
   gboolean mtime_changed, resource_exists;
@@ -71,7 +72,7 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
     identifier = g_strdup (gdata_entry_get_id (entry));
 
   /* remove from the list of the previous resources */
-  g_hash_table_remove (job->previous_resources, identifier);
+  gom_account_miner_job_mark_processed (job, identifier);
 
   if (GDATA_IS_DOCUMENTS_PRESENTATION (doc_entry))
     class = "nfo:Presentation";
@@ -281,13 +282,12 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
         goto out;
     }
 
-  date = gom_iso8601_from_timestamp (gdata_entry_get_published (entry));
+  gom_iso8601_format (gdata_entry_get_published (entry), date);
   gom_tracker_sparql_connection_insert_or_replace_triple
     (job->connection,
      job->cancellable, error,
      job->datasource_urn, resource,
      "nie:contentCreated", date);
-  g_free (date);
 
   if (*error != NULL)
     goto out;
@@ -313,6 +313,12 @@ query_gdata (GomAccountMinerJob *job,
   GDataDocumentsFeed *feed;
   GList *entries, *l;
 
+  /* the service outlives the access token it was created with */
+  if (!gdata_authorizer_refresh_authorization
+      (gdata_service_get_authorizer (GDATA_SERVICE (job->service)),
+       job->cancellable, error))
+    return;
+
   query = gdata_documents_query_new (NULL);
   gdata_documents_query_set_show_folders (query, TRUE);
   feed = gdata_documents_service_query_documents
@@ -40,17 +40,91 @@ static const gchar introspection_xml[] =
   "  <interface name='org.gnome.OnlineMiners.Miner'>"
   "    <method name='RefreshDB'>"
   "    </method>"
+  "    <method name='RefreshAccounts'>"
+  "      <arg name='AccountIds' type='as' direction='in'/>"
+  "    </method>"
+  "    <signal name='Progress'>"
+  "      <arg name='AccountId' type='s'/>"
+  "      <arg name='Processed' type='u'/>"
+  "      <arg name='TotalEstimate' type='u'/>"
+  "    </signal>"
+  "    <signal name='AccountRefreshed'>"
+  "      <arg name='AccountId' type='s'/>"
+  "      <arg name='Stats' type='a{sv}'/>"
+  "    </signal>"
   "    <property name='DisplayName' type='s' access='read'/>"
   "  </interface>"
   "</node>";
 
 static GDBusNodeInfo *introspection_data = NULL;
-static GCancellable *cancellable = NULL;
 static GMainLoop *loop = NULL;
-static guint name_owner_id = 0;
 static guint autoquit_id = 0;
-static gboolean refreshing = FALSE;
-static GomMiner *miner = NULL;
+static gboolean persist = FALSE;
+
+typedef struct _MinerEntry MinerEntry;
+
+/* the callers waiting for a refresh, and the accounts it covers */
+typedef struct {
+  MinerEntry *entry;
+  GList *invocations;
+  GPtrArray *account_ids; /* NULL for all the accounts */
+} RefreshRequest;
+
+/* one for each miner hosted by the process, each under its own bus
+ * name
+ */
+struct _MinerEntry {
+  const gchar *name;
+  GType type;
+  const gchar *bus_name;
+  const gchar *object_path;
+
+  GDBusConnection *connection;
+  GomMiner *miner;
+  GCancellable *cancellable;
+  guint name_owner_id;
+
+  /* at most one refresh runs at a time; requests arriving meanwhile
+   * are answered by it if it covers their accounts, and everything
+   * they ask for is refreshed once more by a single follow-up refresh
+   */
+  RefreshRequest *current_refresh;
+  RefreshRequest *next_refresh;
+};
+
+static GPtrArray *miners = NULL;
+
+static void
+add_miner (const gchar *name,
+           GType type,
+           const gchar *bus_name,
+           const gchar *object_path)
+{
+  MinerEntry *entry;
+  gchar *persist_env;
+
+  entry = g_slice_new0 (MinerEntry);
+  entry->name = name;
+  entry->type = type;
+  entry->bus_name = bus_name;
+  entry->object_path = object_path;
+
+  g_ptr_array_add (miners, entry);
+
+  /* any of the hosted miners can keep the process around */
+  persist_env = g_strconcat (name, "_MINER_PERSIST", NULL);
+  if (g_getenv (persist_env) != NULL)
+    persist = TRUE;
+  g_free (persist_env);
+}
+
+/* a daemon hosting several miners defines ADD_MINERS to add all of
+ * them before including this file
+ */
+#ifndef ADD_MINERS
+#define ADD_MINERS() \
+  add_miner (MINER_NAME, MINER_TYPE, MINER_BUS_NAME, MINER_OBJECT_PATH)
+#endif
 
 static gboolean
 autoquit_timeout_cb (gpointer _unused)
@@ -66,7 +140,7 @@ autoquit_timeout_cb (gpointer _unused)
 static void
 ensure_autoquit_off (void)
 {
-  if (g_getenv (MINER_NAME "_MINER_PERSIST") != NULL)
+  if (persist)
     return;
 
   if (autoquit_id != 0)
@@ -79,67 +153,277 @@ ensure_autoquit_off (void)
 static void
 ensure_autoquit_on (void)
 {
-  if (g_getenv (MINER_NAME "_MINER_PERSIST") != NULL)
+  guint idx;
+
+  if (persist)
     return;
 
+  for (idx = 0; idx < miners->len; idx++)
+    {
+      MinerEntry *entry = g_ptr_array_index (miners, idx);
+
+      if (entry->current_refresh != NULL)
+        return;
+    }
+
+  ensure_autoquit_off ();
   autoquit_id =
     g_timeout_add_seconds (AUTOQUIT_TIMEOUT,
                            autoquit_timeout_cb, NULL);
 }
 
+static void
+cancel_all (void)
+{
+  guint idx;
+
+  for (idx = 0; idx < miners->len; idx++)
+    {
+      MinerEntry *entry = g_ptr_array_index (miners, idx);
+
+      if (entry->cancellable != NULL)
+        g_cancellable_cancel (entry->cancellable);
+    }
+}
+
 static gboolean
 signal_handler_cb (gpointer user_data)
 {
   GMainLoop *loop = user_data;
 
-  if (cancellable != NULL)
-    g_cancellable_cancel (cancellable);
-
+  cancel_all ();
   g_main_loop_quit (loop);
 
   return FALSE;
 }
 
+static RefreshRequest *
+refresh_request_new (MinerEntry *entry)
+{
+  RefreshRequest *request;
+
+  request = g_slice_new0 (RefreshRequest);
+  request->entry = entry;
+  request->account_ids = g_ptr_array_new_with_free_func (g_free);
+
+  return request;
+}
+
+static void
+refresh_request_free (RefreshRequest *request)
+{
+  g_list_free_full (request->invocations, g_object_unref);
+
+  if (request->account_ids != NULL)
+    g_ptr_array_unref (request->account_ids);
+
+  g_slice_free (RefreshRequest, request);
+}
+
+static gboolean
+refresh_request_has_account (RefreshRequest *request,
+                             const gchar *account_id)
+{
+  guint idx;
+
+  if (request->account_ids == NULL)
+    return TRUE;
+
+  for (idx = 0; idx < request->account_ids->len; idx++)
+    {
+      if (g_strcmp0 (g_ptr_array_index (request->account_ids, idx), account_id) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* account_ids is NULL for all the accounts */
+static gboolean
+refresh_request_covers (RefreshRequest *request,
+                        const gchar * const *account_ids)
+{
+  guint idx;
+
+  if (request->account_ids == NULL)
+    return TRUE;
+
+  if (account_ids == NULL)
+    return FALSE;
+
+  for (idx = 0; account_ids[idx] != NULL; idx++)
+    {
+      if (!refresh_request_has_account (request, account_ids[idx]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+refresh_request_add_accounts (RefreshRequest *request,
+                              const gchar * const *account_ids)
+{
+  guint idx;
+
+  if (account_ids == NULL)
+    {
+      g_clear_pointer (&request->account_ids, g_ptr_array_unref);
+      return;
+    }
+
+  for (idx = 0; account_ids[idx] != NULL; idx++)
+    {
+      if (!refresh_request_has_account (request, account_ids[idx]))
+        g_ptr_array_add (request->account_ids, g_strdup (account_ids[idx]));
+    }
+}
+
+static void
+refresh_request_add_invocation (RefreshRequest *request,
+                                GDBusMethodInvocation *invocation)
+{
+  request->invocations = g_list_prepend (request->invocations,
+                                         g_object_ref (invocation));
+}
+
+static void refresh_request_start (RefreshRequest *request);
+
+static void
+refresh_request_done (RefreshRequest *request,
+                      GError *error)
+{
+  MinerEntry *entry = request->entry;
+  GList *l;
+
+  if (error != NULL)
+    g_printerr ("Failed to refresh the DB cache: %s\n", error->message);
+
+  for (l = request->invocations; l != NULL; l = l->next)
+    {
+      GDBusMethodInvocation *invocation = l->data;
+
+      if (error != NULL)
+        g_dbus_method_invocation_return_gerror (invocation, error);
+      else
+        g_dbus_method_invocation_return_value (invocation, NULL);
+    }
+
+  g_clear_error (&error);
+  refresh_request_free (request);
+  entry->current_refresh = NULL;
+
+  if (entry->next_refresh != NULL)
+    {
+      RefreshRequest *next = entry->next_refresh;
+
+      entry->next_refresh = NULL;
+      refresh_request_start (next);
+    }
+  else
+    {
+      ensure_autoquit_on ();
+    }
+}
+
 static void
 miner_refresh_db_ready_cb (GObject *source,
                            GAsyncResult *res,
                            gpointer user_data)
 {
-  GDBusMethodInvocation *invocation = user_data;
+  RefreshRequest *request = user_data;
   GError *error = NULL;
 
   gom_miner_refresh_db_finish (GOM_MINER (source), res, &error);
+  refresh_request_done (request, error);
+}
 
-  refreshing = FALSE;
-  ensure_autoquit_on ();
+static void
+miner_refresh_accounts_ready_cb (GObject *source,
+                                 GAsyncResult *res,
+                                 gpointer user_data)
+{
+  RefreshRequest *request = user_data;
+  GError *error = NULL;
 
-  if (error != NULL)
+  gom_miner_refresh_accounts_finish (GOM_MINER (source), res, &error);
+  refresh_request_done (request, error);
+}
+
+static void
+refresh_request_start (RefreshRequest *request)
+{
+  MinerEntry *entry = request->entry;
+
+  entry->current_refresh = request;
+
+  g_clear_object (&entry->cancellable);
+  entry->cancellable = g_cancellable_new ();
+
+  if (request->account_ids == NULL)
     {
-      g_printerr ("Failed to refresh the DB cache: %s\n", error->message);
-      g_dbus_method_invocation_return_gerror (invocation, error);
+      gom_miner_refresh_db_async (entry->miner, entry->cancellable,
+                                  miner_refresh_db_ready_cb, request);
     }
   else
     {
-      g_dbus_method_invocation_return_value (invocation, NULL);
+      /* NULL-terminate for gom_miner_refresh_accounts_async */
+      g_ptr_array_add (request->account_ids, NULL);
+      gom_miner_refresh_accounts_async (entry->miner,
+                                        (const gchar * const *) request->account_ids->pdata,
+                                        entry->cancellable,
+                                        miner_refresh_accounts_ready_cb, request);
+      g_ptr_array_remove_index (request->account_ids, request->account_ids->len - 1);
     }
-
-  g_object_unref (invocation);
 }
 
+/* account_ids is NULL for all the accounts */
 static void
-handle_refresh_db (GDBusMethodInvocation *invocation)
+handle_refresh (MinerEntry *entry,
+                GDBusMethodInvocation *invocation,
+                const gchar * const *account_ids)
 {
+  RefreshRequest *request;
+
   ensure_autoquit_off ();
 
-  /* if we're refreshing already, compress with the current request */
-  if (refreshing)
-    return;
+  if (entry->current_refresh == NULL)
+    {
+      request = refresh_request_new (entry);
+      refresh_request_add_accounts (request, account_ids);
+      refresh_request_add_invocation (request, invocation);
+      refresh_request_start (request);
+      return;
+    }
+
+  if (entry->next_refresh == NULL)
+    entry->next_refresh = refresh_request_new (entry);
 
-  refreshing = TRUE;
-  cancellable = g_cancellable_new ();
+  refresh_request_add_accounts (entry->next_refresh, account_ids);
 
-  gom_miner_refresh_db_async (miner, cancellable,
-                              miner_refresh_db_ready_cb, g_object_ref (invocation));
+  if (refresh_request_covers (entry->current_refresh, account_ids))
+    refresh_request_add_invocation (entry->current_refresh, invocation);
+  else
+    refresh_request_add_invocation (entry->next_refresh, invocation);
+}
+
+static void
+handle_refresh_db (MinerEntry *entry,
+                   GDBusMethodInvocation *invocation)
+{
+  handle_refresh (entry, invocation, NULL);
+}
+
+static void
+handle_refresh_accounts (MinerEntry *entry,
+                         GDBusMethodInvocation *invocation,
+                         GVariant *parameters)
+{
+  const gchar **account_ids;
+
+  g_variant_get (parameters, "(^a&s)", &account_ids);
+  handle_refresh (entry, invocation, account_ids);
+  g_free (account_ids);
 }
 
 static void
@@ -152,16 +436,20 @@ handle_method_call (GDBusConnection       *connection,
                     GDBusMethodInvocation *invocation,
                     gpointer               user_data)
 {
+  MinerEntry *entry = user_data;
+
   if (g_strcmp0 (method_name, "RefreshDB") == 0)
-    handle_refresh_db (invocation);
+    handle_refresh_db (entry, invocation);
+  else if (g_strcmp0 (method_name, "RefreshAccounts") == 0)
+    handle_refresh_accounts (entry, invocation, parameters);
   else
     g_assert_not_reached ();
 }
 
 static GVariant *
-handle_get_display_name ()
+handle_get_display_name (MinerEntry *entry)
 {
-  return g_variant_new_string (gom_miner_get_display_name (miner));
+  return g_variant_new_string (gom_miner_get_display_name (entry->miner));
 }
 
 static GVariant *
@@ -173,8 +461,10 @@ handle_get_property (GDBusConnection       *connection,
                      GError               **error,
                      gpointer               user_data)
 {
+  MinerEntry *entry = user_data;
+
   if (g_strcmp0 (property_name, "DisplayName") == 0)
-    return handle_get_display_name ();
+    return handle_get_display_name (entry);
 
   g_assert_not_reached ();
 
@@ -188,20 +478,80 @@ static const GDBusInterfaceVTable interface_vtable =
   NULL, /* set_property */
 };
 
+static void
+miner_progress_cb (GomMiner *self,
+                   const gchar *account_id,
+                   guint processed,
+                   guint total,
+                   gpointer user_data)
+{
+  MinerEntry *entry = user_data;
+
+  g_dbus_connection_emit_signal (entry->connection,
+                                 NULL,
+                                 entry->object_path,
+                                 introspection_data->interfaces[0]->name,
+                                 "Progress",
+                                 g_variant_new ("(suu)", account_id, processed, total),
+                                 NULL);
+}
+
+static void
+miner_account_refreshed_cb (GomMiner *self,
+                            const gchar *account_id,
+                            GVariant *stats,
+                            gpointer user_data)
+{
+  MinerEntry *entry = user_data;
+
+  g_dbus_connection_emit_signal (entry->connection,
+                                 NULL,
+                                 entry->object_path,
+                                 introspection_data->interfaces[0]->name,
+                                 "AccountRefreshed",
+                                 g_variant_new ("(s@a{sv})", account_id, stats),
+                                 NULL);
+}
+
+static void
+miner_display_name_notify_cb (GObject *object,
+                              GParamSpec *pspec,
+                              gpointer user_data)
+{
+  MinerEntry *entry = user_data;
+  GVariantBuilder changed;
+
+  g_variant_builder_init (&changed, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&changed, "{sv}", "DisplayName",
+                         g_variant_new_string (gom_miner_get_display_name (entry->miner)));
+
+  g_dbus_connection_emit_signal (entry->connection,
+                                 NULL,
+                                 entry->object_path,
+                                 "org.freedesktop.DBus.Properties",
+                                 "PropertiesChanged",
+                                 g_variant_new ("(sa{sv}as)",
+                                                introspection_data->interfaces[0]->name,
+                                                &changed,
+                                                NULL),
+                                 NULL);
+}
+
 static void
 on_bus_acquired (GDBusConnection *connection,
                  const gchar *name,
                  gpointer user_data)
 {
+  MinerEntry *entry = user_data;
   GError *error = NULL;
 
   g_debug ("Connected to the session bus: %s", name);
 
   g_dbus_connection_register_object (connection,
-                                     MINER_OBJECT_PATH,
+                                     entry->object_path,
                                      introspection_data->interfaces[0],
                                      &interface_vtable,
-                                     NULL,
+                                     entry,
                                      NULL,
                                      &error);
 
@@ -214,7 +564,24 @@ on_bus_acquired (GDBusConnection *connection,
       _exit (1);
     }
 
-  miner = g_object_new (MINER_TYPE, NULL);
+  g_clear_object (&entry->connection);
+  entry->connection = g_object_ref (connection);
+
+  if (entry->miner == NULL)
+    {
+      entry->miner = g_object_new (entry->type, NULL);
+
+      /* the miner already limits how often progress is reported */
+      g_signal_connect (entry->miner, "progress",
+                        G_CALLBACK (miner_progress_cb), entry);
+      g_signal_connect (entry->miner, "account-refreshed",
+                        G_CALLBACK (miner_account_refreshed_cb), entry);
+
+      /* the miner only knows its display name once GOA is ready */
+      g_signal_connect (entry->miner, "notify::display-name",
+                        G_CALLBACK (miner_display_name_notify_cb), entry);
+    }
+
   g_debug ("Object exported on the session bus");
 }
 
@@ -223,12 +590,14 @@ on_name_lost (GDBusConnection *connection,
               const gchar *name,
               gpointer user_data)
 {
+  MinerEntry *entry = user_data;
+
   g_debug ("Lost bus name: %s, exiting", name);
 
-  if (cancellable != NULL)
-    g_cancellable_cancel (cancellable);
+  if (entry->cancellable != NULL)
+    g_cancellable_cancel (entry->cancellable);
 
-  name_owner_id = 0;
+  entry->name_owner_id = 0;
 }
 
 static void
@@ -243,6 +612,8 @@ int
 main (int argc,
       char **argv)
 {
+  guint idx;
+
   tracker_sched_idle ();
   tracker_ioprio_init ();
 
@@ -255,6 +626,9 @@ main (int argc,
       g_warning ("Couldn't set nice value to 19, %s", (str != NULL) ? str : "no error given");
     }
 
+  miners = g_ptr_array_new ();
+  ADD_MINERS ();
+
   ensure_autoquit_on ();
   loop = g_main_loop_new (NULL, FALSE);
 
@@ -270,19 +644,32 @@ main (int argc,
   introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
   g_assert (introspection_data != NULL);
 
-  name_owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
-                                  MINER_BUS_NAME,
-                                  G_BUS_NAME_OWNER_FLAGS_NONE,
-                                  on_bus_acquired,
-                                  on_name_acquired,
-                                  on_name_lost,
-                                  NULL, NULL);
+  /* the miners share the GOA client, the tracker connection and this
+   * main loop, but each one keeps its own bus name
+   */
+  for (idx = 0; idx < miners->len; idx++)
+    {
+      MinerEntry *entry = g_ptr_array_index (miners, idx);
+
+      entry->name_owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
+                                             entry->bus_name,
+                                             G_BUS_NAME_OWNER_FLAGS_NONE,
+                                             on_bus_acquired,
+                                             on_name_acquired,
+                                             on_name_lost,
+                                             entry, NULL);
+    }
 
   g_main_loop_run (loop);
   g_main_loop_unref (loop);
 
-  if (name_owner_id != 0)
-    g_bus_unown_name (name_owner_id);
+  for (idx = 0; idx < miners->len; idx++)
+    {
+      MinerEntry *entry = g_ptr_array_index (miners, idx);
+
+      if (entry->name_owner_id != 0)
+        g_bus_unown_name (entry->name_owner_id);
+    }
 
   return 0;
 }
@@ -25,15 +25,46 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#include <glib/gstdio.h>
 
 #include "gom-miner.h"
 
+#define DATASOURCE_URN_PREFIX "gd:goa-account:"
+
+#define STATE_GROUP_MINER "Miner"
+#define STATE_GROUP_STATE "State"
+#define STATE_KEY_VERSION "Version"
+
+/* minimum time between two progress signals for an account */
+#define PROGRESS_INTERVAL (G_USEC_PER_SEC / 2)
+
 G_DEFINE_TYPE (GomMiner, gom_miner, G_TYPE_OBJECT)
 
+enum {
+  PROP_0,
+  PROP_DISPLAY_NAME
+};
+
+enum {
+  PROGRESS,
+  ACCOUNT_REFRESHED,
+  NUM_SIGNALS
+};
+
+static guint signals[NUM_SIGNALS] = { 0, };
+
 struct _GomMinerPrivate {
   GoaClient *client;
   GError *client_error;
 
+  /* GOA is set up asynchronously, and a refresh asked for before it
+   * is done waits for it
+   */
+  gboolean client_ready;
+  gboolean refresh_waiting;
+
   TrackerSparqlConnection *connection;
 
   GCancellable *cancellable;
@@ -41,6 +72,15 @@ struct _GomMinerPrivate {
 
   GList *pending_jobs;
 
+  /* account id -> GoaObject, for the accounts of our provider */
+  GHashTable *accounts;
+
+  /* the accounts being refreshed, or NULL for all of them */
+  gchar **refresh_ids;
+
+  /* account id -> service, kept across refreshes */
+  GHashTable *services;
+
   gchar *display_name;
 };
 
@@ -58,6 +98,10 @@ gom_account_miner_job_free (GomAccountMinerJob *job)
 
   g_free (job->datasource_urn);
   g_free (job->root_element_urn);
+  g_free (job->state_path);
+
+  if (job->state != NULL)
+    g_key_file_free (job->state);
 
   g_hash_table_unref (job->previous_resources);
 
@@ -76,10 +120,18 @@ gom_miner_dispose (GObject *object)
       self->priv->pending_jobs = NULL;
     }
 
-  g_clear_object (&self->priv->client);
+  if (self->priv->client != NULL)
+    {
+      g_signal_handlers_disconnect_by_data (self->priv->client, self);
+      g_clear_object (&self->priv->client);
+    }
+
   g_clear_object (&self->priv->connection);
   g_clear_object (&self->priv->cancellable);
   g_clear_object (&self->priv->result);
+  g_clear_pointer (&self->priv->services, g_hash_table_unref);
+  g_clear_pointer (&self->priv->accounts, g_hash_table_unref);
+  g_clear_pointer (&self->priv->refresh_ids, g_strfreev);
 
   g_free (self->priv->display_name);
   g_clear_error (&self->priv->client_error);
@@ -87,43 +139,242 @@ gom_miner_dispose (GObject *object)
   G_OBJECT_CLASS (gom_miner_parent_class)->dispose (object);
 }
 
+static GoaAccount *
+gom_miner_peek_own_account (GomMiner *self,
+                            GoaObject *object)
+{
+  GomMinerClass *miner_class = GOM_MINER_GET_CLASS (self);
+  GoaAccount *account;
+
+  account = goa_object_peek_account (object);
+  if (account == NULL)
+    return NULL;
+
+  if (g_strcmp0 (goa_account_get_provider_type (account), miner_class->goa_provider_type) != 0)
+    return NULL;
+
+  return account;
+}
+
+/* the display name is that of the provider of the first account */
 static void
-gom_miner_init_goa (GomMiner *self)
+gom_miner_add_account (GomMiner *self,
+                       GoaObject *object,
+                       GoaAccount *account)
 {
+  if (g_hash_table_size (self->priv->accounts) == 0)
+    {
+      gchar *display_name;
+
+      display_name = goa_account_dup_provider_name (account);
+      if (g_strcmp0 (display_name, self->priv->display_name) != 0)
+        {
+          g_free (self->priv->display_name);
+          self->priv->display_name = display_name;
+          g_object_notify (G_OBJECT (self), "display-name");
+        }
+      else
+        g_free (display_name);
+    }
+
+  g_hash_table_insert (self->priv->accounts,
+                       goa_account_dup_id (account),
+                       g_object_ref (object));
+}
+
+static void
+gom_miner_account_added_cb (GoaClient *client,
+                            GoaObject *object,
+                            gpointer user_data)
+{
+  GomMiner *self = user_data;
+  GoaAccount *account;
+
+  account = gom_miner_peek_own_account (self, object);
+  if (account == NULL)
+    return;
+
+  gom_miner_add_account (self, object, account);
+}
+
+/* a changed account may come with new credentials or a different
+ * server, so the service is created again on the next refresh
+ */
+static void
+gom_miner_account_changed_cb (GoaClient *client,
+                              GoaObject *object,
+                              gpointer user_data)
+{
+  GomMiner *self = user_data;
+  GoaAccount *account;
+
+  account = gom_miner_peek_own_account (self, object);
+  if (account == NULL)
+    return;
+
+  g_hash_table_remove (self->priv->services, goa_account_get_id (account));
+  g_hash_table_insert (self->priv->accounts,
+                       goa_account_dup_id (account),
+                       g_object_ref (object));
+}
+
+static void
+gom_miner_account_removed_cb (GoaClient *client,
+                              GoaObject *object,
+                              gpointer user_data)
+{
+  GomMiner *self = user_data;
+  GoaAccount *account;
+
+  account = gom_miner_peek_own_account (self, object);
+  if (account == NULL)
+    return;
+
+  g_hash_table_remove (self->priv->services, goa_account_get_id (account));
+  g_hash_table_remove (self->priv->accounts, goa_account_get_id (account));
+}
+
+/* miners hosted by the same process share a single GoaClient; it
+ * goes away with the last of them
+ */
+static GoaClient *shared_client = NULL;
+static GList *shared_client_waiters = NULL;
+
+static void
+shared_client_ready_cb (GObject *source,
+                        GAsyncResult *res,
+                        gpointer user_data)
+{
+  GError *error = NULL;
+  GList *waiters, *l;
+  GoaClient *client;
+
+  client = goa_client_new_finish (res, &error);
+  if (client != NULL)
+    {
+      shared_client = client;
+      g_object_add_weak_pointer (G_OBJECT (shared_client), (gpointer *) &shared_client);
+    }
+
+  waiters = shared_client_waiters;
+  shared_client_waiters = NULL;
+
+  for (l = waiters; l != NULL; l = l->next)
+    {
+      GSimpleAsyncResult *result = l->data;
+
+      if (error != NULL)
+        g_simple_async_result_set_from_error (result, error);
+      else
+        g_simple_async_result_set_op_res_gpointer (result, g_object_ref (client), g_object_unref);
+
+      g_simple_async_result_complete (result);
+      g_object_unref (result);
+    }
+
+  g_list_free (waiters);
+  g_clear_error (&error);
+  g_clear_object (&client);
+}
+
+static void
+gom_miner_get_goa_client_async (GAsyncReadyCallback callback,
+                                gpointer user_data)
+{
+  GSimpleAsyncResult *result;
+
+  result = g_simple_async_result_new (NULL, callback, user_data,
+                                      gom_miner_get_goa_client_async);
+
+  if (shared_client != NULL)
+    {
+      g_simple_async_result_set_op_res_gpointer (result, g_object_ref (shared_client), g_object_unref);
+      g_simple_async_result_complete_in_idle (result);
+      g_object_unref (result);
+      return;
+    }
+
+  /* only the first caller creates the client, the others wait for it */
+  shared_client_waiters = g_list_prepend (shared_client_waiters, result);
+  if (shared_client_waiters->next == NULL)
+    goa_client_new (NULL, shared_client_ready_cb, NULL);
+}
+
+static GoaClient *
+gom_miner_get_goa_client_finish (GAsyncResult *res,
+                                 GError **error)
+{
+  GSimpleAsyncResult *simple_res = G_SIMPLE_ASYNC_RESULT (res);
+
+  g_assert (g_simple_async_result_is_valid (res, NULL,
+                                            gom_miner_get_goa_client_async));
+
+  if (g_simple_async_result_propagate_error (simple_res, error))
+    return NULL;
+
+  return g_object_ref (g_simple_async_result_get_op_res_gpointer (simple_res));
+}
+
+static void gom_miner_complete_error (GomMiner *self, GError *error);
+static void gom_miner_refresh_db_real (GomMiner *self);
+
+static void
+gom_miner_goa_client_ready_cb (GObject *source,
+                               GAsyncResult *res,
+                               gpointer user_data)
+{
+  GomMiner *self = user_data;
   GoaAccount *account;
   GoaObject *object;
-  const gchar *provider_type;
   GList *accounts, *l;
   GomMinerClass *miner_class = GOM_MINER_GET_CLASS (self);
 
-  self->priv->client = goa_client_new_sync (NULL, &self->priv->client_error);
+  self->priv->client = gom_miner_get_goa_client_finish (res, &self->priv->client_error);
+  self->priv->client_ready = TRUE;
 
   if (self->priv->client_error != NULL)
     {
       g_critical ("Unable to create GoaClient: %s - indexing for %s will not work",
                   self->priv->client_error->message, miner_class->goa_provider_type);
-      return;
+      goto out;
     }
 
+  /* keep the index of our accounts up to date, so that refreshes do
+   * not have to go through all the accounts again
+   */
+  g_signal_connect (self->priv->client, "account-added",
+                    G_CALLBACK (gom_miner_account_added_cb), self);
+  g_signal_connect (self->priv->client, "account-changed",
+                    G_CALLBACK (gom_miner_account_changed_cb), self);
+  g_signal_connect (self->priv->client, "account-removed",
+                    G_CALLBACK (gom_miner_account_removed_cb), self);
+
   accounts = goa_client_get_accounts (self->priv->client);
   for (l = accounts; l != NULL; l = l->next)
     {
       object = l->data;
 
-      account = goa_object_peek_account (object);
+      account = gom_miner_peek_own_account (self, object);
       if (account == NULL)
         continue;
 
-      provider_type = goa_account_get_provider_type (account);
-      if (g_strcmp0 (provider_type, miner_class->goa_provider_type) == 0)
-        {
-          g_free (self->priv->display_name);
-          self->priv->display_name = goa_account_dup_provider_name (account);
-          break;
-        }
+      gom_miner_add_account (self, object, account);
     }
 
   g_list_free_full (accounts, g_object_unref);
+
+ out:
+  if (self->priv->refresh_waiting)
+    {
+      self->priv->refresh_waiting = FALSE;
+
+      if (self->priv->client_error != NULL)
+        gom_miner_complete_error (self, g_error_copy (self->priv->client_error));
+      else
+        gom_miner_refresh_db_real (self);
+    }
+
+  g_object_unref (self);
 }
 
 static void
@@ -133,7 +384,10 @@ gom_miner_constructed (GObject *obj)
 
   G_OBJECT_CLASS (gom_miner_parent_class)->constructed (obj);
 
-  gom_miner_init_goa (self);
+  /* do not block the main loop, nor whoever is creating the miner, on
+   * GOA; refreshes wait for it instead
+   */
+  gom_miner_get_goa_client_async (gom_miner_goa_client_ready_cb, g_object_ref (self));
 }
 
 static void
@@ -141,6 +395,29 @@ gom_miner_init (GomMiner *self)
 {
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, GOM_TYPE_MINER, GomMinerPrivate);
   self->priv->display_name = g_strdup ("");
+  self->priv->services = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_object_unref);
+  self->priv->accounts = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, g_object_unref);
+}
+
+static void
+gom_miner_get_property (GObject *object,
+                        guint prop_id,
+                        GValue *value,
+                        GParamSpec *pspec)
+{
+  GomMiner *self = GOM_MINER (object);
+
+  switch (prop_id)
+    {
+    case PROP_DISPLAY_NAME:
+      g_value_set_string (value, self->priv->display_name);
+      break;
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+      break;
+    }
 }
 
 static void
@@ -150,6 +427,39 @@ gom_miner_class_init (GomMinerClass *klass)
 
   oclass->constructed = gom_miner_constructed;
   oclass->dispose = gom_miner_dispose;
+  oclass->get_property = gom_miner_get_property;
+
+  /* only known once GOA is ready, which is after construction */
+  g_object_class_install_property (oclass,
+                                   PROP_DISPLAY_NAME,
+                                   g_param_spec_string ("display-name",
+                                                        "Display name",
+                                                        "The name of the provider of the accounts",
+                                                        "",
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_STATIC_STRINGS));
+
+  /* processed is how many items of the account were seen so far, and
+   * total an estimate based on what the previous refresh found
+   */
+  signals[PROGRESS] =
+    g_signal_new ("progress",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 3,
+                  G_TYPE_STRING, G_TYPE_UINT, G_TYPE_UINT);
+
+  /* stats is an a{sv} with "processed", "removed", "duration" and,
+   * if the refresh failed, "error"
+   */
+  signals[ACCOUNT_REFRESHED] =
+    g_signal_new ("account-refreshed",
+                  G_TYPE_FROM_CLASS (klass),
+                  G_SIGNAL_RUN_LAST,
+                  0, NULL, NULL, NULL,
+                  G_TYPE_NONE, 2,
+                  G_TYPE_STRING, G_TYPE_VARIANT);
 
   g_type_class_add_private (klass, sizeof (GomMinerPrivate));
 }
@@ -197,6 +507,55 @@ gom_account_miner_job_ensure_datasource (GomAccountMinerJob *job,
   g_string_free (datasource_insert, TRUE);
 }
 
+static void
+gom_account_miner_job_migrate (GomAccountMinerJob *job,
+                               GError **error)
+{
+  GomMinerClass *klass = GOM_MINER_GET_CLASS (job->miner);
+  GString *select;
+  TrackerSparqlCursor *cursor;
+  const gchar *old_version_str;
+  gint old_version = 0;
+
+  if (klass->migrate == NULL)
+    return;
+
+  /* has to happen before gom_account_miner_job_ensure_datasource
+   * stores the current version
+   */
+  select = g_string_new (NULL);
+  g_string_append_printf (select,
+                          "SELECT nie:version(?root) WHERE { ?root nie:rootElementOf <%s> }",
+                          job->datasource_urn);
+
+  cursor = tracker_sparql_connection_query (job->connection,
+                                            select->str,
+                                            job->cancellable,
+                                            error);
+  g_string_free (select, TRUE);
+
+  if (cursor == NULL)
+    return;
+
+  if (tracker_sparql_cursor_next (cursor, job->cancellable, error))
+    {
+      old_version_str = tracker_sparql_cursor_get_string (cursor, 0, NULL);
+      if (old_version_str == NULL)
+        old_version = 1;
+      else
+        sscanf (old_version_str, "%d", &old_version);
+    }
+
+  g_object_unref (cursor);
+
+  /* nothing stored yet, or already up to date */
+  if (*error != NULL || old_version == 0 || old_version >= klass->version)
+    return;
+
+  g_debug ("Migrating %s from version %d to %d", job->datasource_urn, old_version, klass->version);
+  klass->migrate (job, old_version, error);
+}
+
 static void
 gom_account_miner_job_query_existing (GomAccountMinerJob *job,
                                       GError **error)
@@ -228,6 +587,188 @@ gom_account_miner_job_query_existing (GomAccountMinerJob *job,
   g_object_unref (cursor);
 }
 
+static gchar *
+gom_miner_build_state_path (GomMiner *self,
+                            const gchar *account_id)
+{
+  GomMinerClass *klass = GOM_MINER_GET_CLASS (self);
+  gchar *basename, *path;
+
+  basename = g_strdup_printf ("%s-%s.state", klass->goa_provider_type, account_id);
+  path = g_build_filename (g_get_user_cache_dir (), "gnome-online-miners", basename, NULL);
+  g_free (basename);
+
+  return path;
+}
+
+static void
+gom_account_miner_job_load_state (GomAccountMinerJob *job)
+{
+  GomMinerClass *klass = GOM_MINER_GET_CLASS (job->miner);
+  GError *error = NULL;
+  gint version;
+
+  job->state = g_key_file_new ();
+
+  if (!g_key_file_load_from_file (job->state, job->state_path, G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Unable to load the state from %s: %s", job->state_path, error->message);
+
+      g_error_free (error);
+      return;
+    }
+
+  /* the state describes what is already in the store, so throw it
+   * away if the store has nothing for this account, or if it was
+   * written by a different version of the miner.
+   */
+  version = g_key_file_get_integer (job->state, STATE_GROUP_MINER, STATE_KEY_VERSION, NULL);
+  if (version != klass->version || g_hash_table_size (job->previous_resources) == 0)
+    {
+      g_debug ("Discarding stale state %s", job->state_path);
+
+      g_key_file_free (job->state);
+      job->state = g_key_file_new ();
+      job->state_dirty = TRUE;
+    }
+}
+
+typedef struct {
+  GomMiner *miner;
+  gchar *account_id;
+  guint processed;
+  guint total;
+} ProgressData;
+
+static gboolean
+progress_data_emit (gpointer user_data)
+{
+  ProgressData *data = user_data;
+
+  g_signal_emit (data->miner, signals[PROGRESS], 0,
+                 data->account_id, data->processed, data->total);
+
+  return FALSE;
+}
+
+static void
+progress_data_free (gpointer user_data)
+{
+  ProgressData *data = user_data;
+
+  g_object_unref (data->miner);
+  g_free (data->account_id);
+  g_slice_free (ProgressData, data);
+}
+
+/* progress is sent to the main thread at most every PROGRESS_INTERVAL */
+static void
+gom_account_miner_job_report_progress (GomAccountMinerJob *job)
+{
+  ProgressData *data;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  if (now - job->last_progress_time < PROGRESS_INTERVAL)
+    return;
+
+  job->last_progress_time = now;
+
+  data = g_slice_new (ProgressData);
+  data->miner = g_object_ref (job->miner);
+  data->account_id = goa_account_dup_id (job->account);
+  data->processed = job->n_processed;
+  data->total = MAX (job->n_total, job->n_processed);
+
+  g_idle_add_full (G_PRIORITY_DEFAULT,
+                   progress_data_emit,
+                   data, progress_data_free);
+}
+
+/* called by the miners for every item they come across, from the
+ * job's thread
+ */
+void
+gom_account_miner_job_mark_processed (GomAccountMinerJob *job,
+                                      const gchar *identifier)
+{
+  g_hash_table_remove (job->previous_resources, identifier);
+  job->n_processed++;
+
+  gom_account_miner_job_report_progress (job);
+}
+
+/* like gom_account_miner_job_mark_processed, for stored items that are
+ * kept as they are without being looked at; only those still waiting
+ * for the cleanup are counted
+ */
+void
+gom_account_miner_job_mark_kept (GomAccountMinerJob *job,
+                                 const gchar *identifier)
+{
+  if (!g_hash_table_remove (job->previous_resources, identifier))
+    return;
+
+  job->n_processed++;
+
+  gom_account_miner_job_report_progress (job);
+}
+
+gchar *
+gom_account_miner_job_get_state (GomAccountMinerJob *job,
+                                 const gchar *key)
+{
+  g_return_val_if_fail (job->state != NULL, NULL);
+
+  return g_key_file_get_string (job->state, STATE_GROUP_STATE, key, NULL);
+}
+
+void
+gom_account_miner_job_set_state (GomAccountMinerJob *job,
+                                 const gchar *key,
+                                 const gchar *value)
+{
+  g_return_if_fail (job->state != NULL);
+
+  if (value != NULL)
+    g_key_file_set_string (job->state, STATE_GROUP_STATE, key, value);
+  else
+    g_key_file_remove_key (job->state, STATE_GROUP_STATE, key, NULL);
+
+  job->state_dirty = TRUE;
+}
+
+void
+gom_account_miner_job_save_state (GomAccountMinerJob *job)
+{
+  GomMinerClass *klass = GOM_MINER_GET_CLASS (job->miner);
+  GError *error = NULL;
+  gchar *data;
+  gchar *dirname;
+  gsize length;
+
+  if (job->state == NULL || !job->state_dirty)
+    return;
+
+  g_key_file_set_integer (job->state, STATE_GROUP_MINER, STATE_KEY_VERSION, klass->version);
+  data = g_key_file_to_data (job->state, &length, NULL);
+
+  dirname = g_path_get_dirname (job->state_path);
+  g_mkdir_with_parents (dirname, 0700);
+  g_free (dirname);
+
+  if (g_file_set_contents (job->state_path, data, length, &error))
+    job->state_dirty = FALSE;
+  else
+    {
+      g_warning ("Unable to save the state to %s: %s", job->state_path, error->message);
+      g_error_free (error);
+    }
+
+  g_free (data);
+}
+
 static void
 previous_resources_cleanup_foreach (gpointer key,
                                     gpointer value,
@@ -251,6 +792,8 @@ gom_account_miner_job_cleanup_previous (GomAccountMinerJob *job,
   /* the resources left here are those who were in the database,
    * but were not found during the query; remove them from the database.
    */
+  job->n_removed = g_hash_table_size (job->previous_resources);
+
   g_hash_table_foreach (job->previous_resources,
                         previous_resources_cleanup_foreach,
                         delete);
@@ -283,6 +826,11 @@ gom_account_miner_job (GIOSchedulerJob *sched_job,
   GomAccountMinerJob *job = user_data;
   GError *error = NULL;
 
+  gom_account_miner_job_migrate (job, &error);
+
+  if (error != NULL)
+    goto out;
+
   gom_account_miner_job_ensure_datasource (job, &error);
 
   if (error != NULL)
@@ -293,8 +841,16 @@ gom_account_miner_job (GIOSchedulerJob *sched_job,
   if (error != NULL)
     goto out;
 
+  gom_account_miner_job_load_state (job);
+
+  job->n_total = g_hash_table_size (job->previous_resources);
   gom_account_miner_job_query (job, &error);
 
+  /* save the state even if the query failed, so that an interrupted
+   * job can pick up where it left off
+   */
+  gom_account_miner_job_save_state (job);
+
   if (error != NULL)
     goto out;
 
@@ -353,13 +909,38 @@ miner_cancellable_cancelled_cb (GCancellable *cancellable,
   g_cancellable_cancel (job->cancellable);
 }
 
+/* services are shared by all the refreshes of an account, so that
+ * their HTTP connections and authorization outlive a single job
+ */
+static GObject *
+gom_miner_ensure_service (GomMiner *self,
+                          GoaObject *object)
+{
+  GomMinerClass *miner_class = GOM_MINER_GET_CLASS (self);
+  GObject *service;
+  const gchar *account_id;
+
+  account_id = goa_account_get_id (goa_object_peek_account (object));
+
+  service = g_hash_table_lookup (self->priv->services, account_id);
+  if (service == NULL)
+    {
+      service = miner_class->create_service (self, object);
+      if (service == NULL)
+        return NULL;
+
+      g_hash_table_insert (self->priv->services, g_strdup (account_id), service);
+    }
+
+  return g_object_ref (service);
+}
+
 static GomAccountMinerJob *
 gom_account_miner_job_new (GomMiner *self,
                            GoaObject *object)
 {
   GomAccountMinerJob *retval;
   GoaAccount *account;
-  GomMinerClass *miner_class = GOM_MINER_GET_CLASS (self);
 
   account = goa_object_get_account (object);
   g_assert (account != NULL);
@@ -379,15 +960,46 @@ gom_account_miner_job_new (GomMiner *self,
                                G_CALLBACK (miner_cancellable_cancelled_cb),
                                retval, NULL);
 
-  retval->service = miner_class->create_service (self, object);
+  retval->service = gom_miner_ensure_service (self, object);
   retval->datasource_urn = g_strdup_printf ("gd:goa-account:%s",
                                             goa_account_get_id (retval->account));
+  retval->state_path = gom_miner_build_state_path (self, goa_account_get_id (retval->account));
   retval->root_element_urn = g_strdup_printf ("gd:goa-account:%s:root-element",
                                               goa_account_get_id (retval->account));
+  retval->start_time = g_get_monotonic_time ();
 
   return retval;
 }
 
+/* called on the main thread, once the job is done */
+static void
+gom_account_miner_job_emit_refreshed (GomAccountMinerJob *job,
+                                      const GError *error)
+{
+  GVariantBuilder builder;
+  GVariant *stats;
+  const gchar *account_id;
+
+  account_id = goa_account_get_id (job->account);
+
+  g_signal_emit (job->miner, signals[PROGRESS], 0,
+                 account_id, job->n_processed, job->n_processed);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+  g_variant_builder_add (&builder, "{sv}", "processed", g_variant_new_uint32 (job->n_processed));
+  g_variant_builder_add (&builder, "{sv}", "removed", g_variant_new_uint32 (job->n_removed));
+  g_variant_builder_add (&builder, "{sv}", "duration",
+                         g_variant_new_double ((g_get_monotonic_time () - job->start_time)
+                                               / (gdouble) G_USEC_PER_SEC));
+
+  if (error != NULL)
+    g_variant_builder_add (&builder, "{sv}", "error", g_variant_new_string (error->message));
+
+  stats = g_variant_ref_sink (g_variant_builder_end (&builder));
+  g_signal_emit (job->miner, signals[ACCOUNT_REFRESHED], 0, account_id, stats);
+  g_variant_unref (stats);
+}
+
 static void
 miner_job_process_ready_cb (GObject *source,
                             GAsyncResult *res,
@@ -400,12 +1012,11 @@ miner_job_process_ready_cb (GObject *source,
   gom_account_miner_job_process_finish (res, &error);
 
   if (error != NULL)
-    {
-      g_printerr ("Error while refreshing account %s: %s",
-                  goa_account_get_id (job->account), error->message);
+    g_printerr ("Error while refreshing account %s: %s",
+                goa_account_get_id (job->account), error->message);
 
-      g_error_free (error);
-    }
+  gom_account_miner_job_emit_refreshed (job, error);
+  g_clear_error (&error);
 
   self->priv->pending_jobs = g_list_remove (self->priv->pending_jobs,
                                             job);
@@ -496,6 +1107,15 @@ cleanup_job_do_cleanup (CleanupJob *job)
       resource = l->data;
       g_debug ("Cleaning up old datasource %s", resource);
 
+      if (g_str_has_prefix (resource, DATASOURCE_URN_PREFIX))
+        {
+          gchar *state_path;
+
+          state_path = gom_miner_build_state_path (self, resource + strlen (DATASOURCE_URN_PREFIX));
+          g_unlink (state_path);
+          g_free (state_path);
+        }
+
       g_string_append_printf (update,
                               "DELETE {"
                               "  ?u a rdfs:Resource"
@@ -585,7 +1205,8 @@ cleanup_job (GIOSchedulerJob *sched_job,
        * In fact, we only remove all the account data in case the account
        * is really removed from the panel.
        *
-       * Also, cleanup sources for which the version has increased.
+       * Also, cleanup sources for which the version has increased,
+       * unless the miner knows how to migrate them.
        */
       datasource = tracker_sparql_cursor_get_string (cursor, 0, NULL);
       element = g_list_find_custom (job->acc_objects, datasource,
@@ -603,7 +1224,7 @@ cleanup_job (GIOSchedulerJob *sched_job,
 
       g_debug ("Stored version: %d - new version %d", old_version, klass->version);
 
-      if ((element == NULL) || (old_version < klass->version))
+      if ((element == NULL) || (old_version < klass->version && klass->migrate == NULL))
         {
           job->old_datasources = g_list_prepend (job->old_datasources,
                                                  g_strdup (datasource));
@@ -637,35 +1258,49 @@ gom_miner_cleanup_old_accounts (GomMiner *self,
                            self->priv->cancellable);
 }
 
+static gboolean
+gom_miner_is_refreshing_account (GomMiner *self,
+                                 const gchar *account_id)
+{
+  guint idx;
+
+  if (self->priv->refresh_ids == NULL)
+    return TRUE;
+
+  for (idx = 0; self->priv->refresh_ids[idx] != NULL; idx++)
+    {
+      if (g_strcmp0 (self->priv->refresh_ids[idx], account_id) == 0)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
 static void
 gom_miner_refresh_db_real (GomMiner *self)
 {
+  GHashTableIter iter;
   GoaDocuments *documents;
   GoaPhotos *photos;
-  GoaAccount *account;
   GoaObject *object;
-  const gchar *provider_type;
-  GList *accounts, *content_objects, *acc_objects, *l;
-  GomMinerClass *miner_class = GOM_MINER_GET_CLASS (self);
+  GList *content_objects, *acc_objects;
+  gpointer account_id;
 
   content_objects = NULL;
   acc_objects = NULL;
 
-  accounts = goa_client_get_accounts (self->priv->client);
-  for (l = accounts; l != NULL; l = l->next)
+  /* all the accounts are passed on for the cleanup, so that only the
+   * data of removed accounts goes away, even if just a few of them
+   * are refreshed
+   */
+  g_hash_table_iter_init (&iter, self->priv->accounts);
+  while (g_hash_table_iter_next (&iter, &account_id, (gpointer *) &object))
     {
-      object = l->data;
-
-      account = goa_object_peek_account (object);
-      if (account == NULL)
-        continue;
+      acc_objects = g_list_append (acc_objects, g_object_ref (object));
 
-      provider_type = goa_account_get_provider_type (account);
-      if (g_strcmp0 (provider_type, miner_class->goa_provider_type) != 0)
+      if (!gom_miner_is_refreshing_account (self, account_id))
         continue;
 
-      acc_objects = g_list_append (acc_objects, g_object_ref (object));
-
       documents = goa_object_peek_documents (object);
       photos = goa_object_peek_photos (object);
       if (documents == NULL && photos == NULL)
@@ -674,8 +1309,6 @@ gom_miner_refresh_db_real (GomMiner *self)
       content_objects = g_list_append (content_objects, g_object_ref (object));
     }
 
-  g_list_free_full (accounts, g_object_unref);
-
   gom_miner_cleanup_old_accounts (self, content_objects, acc_objects);
 }
 
@@ -687,6 +1320,7 @@ sparql_connection_ready_cb (GObject *object,
   GError *error = NULL;
   GomMiner *self = user_data;
 
+  g_clear_object (&self->priv->connection);
   self->priv->connection = tracker_sparql_connection_get_finish (res, &error);
 
   if (error != NULL)
@@ -695,6 +1329,18 @@ sparql_connection_ready_cb (GObject *object,
       return;
     }
 
+  if (!self->priv->client_ready)
+    {
+      self->priv->refresh_waiting = TRUE;
+      return;
+    }
+
+  if (self->priv->client_error != NULL)
+    {
+      gom_miner_complete_error (self, g_error_copy (self->priv->client_error));
+      return;
+    }
+
   gom_miner_refresh_db_real (self);
 }
 
@@ -704,29 +1350,52 @@ gom_miner_get_display_name (GomMiner *self)
   return self->priv->display_name;
 }
 
-void
-gom_miner_refresh_db_async (GomMiner *self,
+static void
+gom_miner_refresh_internal (GomMiner *self,
+                            const gchar * const *account_ids,
                             GCancellable *cancellable,
                             GAsyncReadyCallback callback,
-                            gpointer user_data)
+                            gpointer user_data,
+                            gpointer source_tag)
 {
-  if (self->priv->client_error != NULL)
-    {
-      gom_miner_complete_error (self, self->priv->client_error);
-      return;
-    }
+  /* the previous refresh, if any, is over by now */
+  g_clear_object (&self->priv->result);
+  g_clear_object (&self->priv->cancellable);
 
   self->priv->result =
     g_simple_async_result_new (G_OBJECT (self),
                                callback, user_data,
-                               gom_miner_refresh_db_async);
+                               source_tag);
   self->priv->cancellable =
     (cancellable != NULL) ? g_object_ref (cancellable) : NULL;
 
+  g_strfreev (self->priv->refresh_ids);
+  self->priv->refresh_ids = g_strdupv ((gchar **) account_ids);
+
+  if (self->priv->client_error != NULL)
+    {
+      gom_miner_complete_error (self, g_error_copy (self->priv->client_error));
+      return;
+    }
+
+  /* the tracker connection is set up while GOA, if it is not ready
+   * yet, still is
+   */
   tracker_sparql_connection_get_async (self->priv->cancellable,
                                        sparql_connection_ready_cb, self);
 }
 
+void
+gom_miner_refresh_db_async (GomMiner *self,
+                            GCancellable *cancellable,
+                            GAsyncReadyCallback callback,
+                            gpointer user_data)
+{
+  gom_miner_refresh_internal (self, NULL, cancellable,
+                              callback, user_data,
+                              gom_miner_refresh_db_async);
+}
+
 gboolean
 gom_miner_refresh_db_finish (GomMiner *self,
                              GAsyncResult *res,
@@ -742,3 +1411,36 @@ gom_miner_refresh_db_finish (GomMiner *self,
 
   return TRUE;
 }
+
+/* like gom_miner_refresh_db_async, but only for the given accounts;
+ * ids of accounts that do not belong to this miner are ignored
+ */
+void
+gom_miner_refresh_accounts_async (GomMiner *self,
+                                  const gchar * const *account_ids,
+                                  GCancellable *cancellable,
+                                  GAsyncReadyCallback callback,
+                                  gpointer user_data)
+{
+  g_return_if_fail (account_ids != NULL);
+
+  gom_miner_refresh_internal (self, account_ids, cancellable,
+                              callback, user_data,
+                              gom_miner_refresh_accounts_async);
+}
+
+gboolean
+gom_miner_refresh_accounts_finish (GomMiner *self,
+                                   GAsyncResult *res,
+                                   GError **error)
+{
+  GSimpleAsyncResult *simple_res = G_SIMPLE_ASYNC_RESULT (res);
+
+  g_assert (g_simple_async_result_is_valid (res, G_OBJECT (self),
+                                            gom_miner_refresh_accounts_async));
+
+  if (g_simple_async_result_propagate_error (simple_res, error))
+    return FALSE;
+
+  return TRUE;
+}
@@ -71,6 +71,17 @@ typedef struct {
   GHashTable *previous_resources;
   gchar *datasource_urn;
   gchar *root_element_urn;
+
+  GKeyFile *state;
+  gchar *state_path;
+  gboolean state_dirty;
+
+  /* only touched from the job's thread until it is done */
+  guint n_processed;
+  guint n_removed;
+  guint n_total;
+  gint64 last_progress_time;
+  gint64 start_time;
 } GomAccountMinerJob;
 
 struct _GomMiner
@@ -93,6 +104,13 @@ struct _GomMinerClass
 
   void (*query) (GomAccountMinerJob *job,
                  GError **error);
+
+  /* if set, called instead of wiping an account's data when it was
+   * written by an older version of the miner
+   */
+  void (*migrate) (GomAccountMinerJob *job,
+                   gint old_version,
+                   GError **error);
 };
 
 GType gom_miner_get_type (void);
@@ -108,6 +126,31 @@ gboolean gom_miner_refresh_db_finish (GomMiner *self,
                                       GAsyncResult *res,
                                       GError **error);
 
+void gom_miner_refresh_accounts_async (GomMiner *self,
+                                       const gchar * const *account_ids,
+                                       GCancellable *cancellable,
+                                       GAsyncReadyCallback callback,
+                                       gpointer user_data);
+
+gboolean gom_miner_refresh_accounts_finish (GomMiner *self,
+                                            GAsyncResult *res,
+                                            GError **error);
+
+gchar *gom_account_miner_job_get_state (GomAccountMinerJob *job,
+                                        const gchar *key);
+
+void gom_account_miner_job_set_state (GomAccountMinerJob *job,
+                                      const gchar *key,
+                                      const gchar *value);
+
+void gom_account_miner_job_save_state (GomAccountMinerJob *job);
+
+void gom_account_miner_job_mark_processed (GomAccountMinerJob *job,
+                                           const gchar *identifier);
+
+void gom_account_miner_job_mark_kept (GomAccountMinerJob *job,
+                                      const gchar *identifier);
+
 G_END_DECLS
 
 #endif /* __GOM_MINER_H__ */
@@ -23,10 +23,14 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include <goa/goa.h>
 
+#include "gom-crawler.h"
 #include "gom-owncloud-miner.h"
 #include "gom-utils.h"
+#include "gom-webdav.h"
 
 #define MINER_IDENTIFIER "gd:owncloud:miner:8a409711-8fea-4eda-a417-f140ffc6d8f3"
 
@@ -34,9 +38,37 @@ G_DEFINE_TYPE (GomOwncloudMiner, gom_owncloud_miner, GOM_TYPE_MINER)
 
 struct _GomOwncloudMinerPrivate {
   GVolumeMonitor *monitor;
+  gboolean webdav;
+  gboolean webdav_infinite_depth;
+  guint max_depth;
+  guint max_listings;
 };
 
+/* number of directories being enumerated at the same time; can be
+ * overridden with OWNCLOUD_MINER_MAX_LISTINGS
+ */
+#define DEFAULT_MAX_LISTINGS 4
+
+/* directories deeper than this are not walked; can be overridden with
+ * OWNCLOUD_MINER_MAX_DEPTH
+ */
+#define DEFAULT_MAX_DEPTH G_MAXUINT
+
+/* number of children requested per g_file_enumerator_next_files_async */
+#define FILES_PER_BATCH 100
+
+/* prefix of the state keys holding the ETag, or failing that the
+ * mtime, that a directory had when its subtree was last walked
+ */
+#define STATE_STAMP_PREFIX "stamp:"
+
+/* number of resources whose identifier is rewritten per update when
+ * migrating from version 1
+ */
+#define MIGRATE_BATCH_SIZE 100
+
 #define FILE_ATTRIBUTES \
+  G_FILE_ATTRIBUTE_ETAG_VALUE "," \
   G_FILE_ATTRIBUTE_STANDARD_CONTENT_TYPE "," \
   G_FILE_ATTRIBUTE_STANDARD_DISPLAY_NAME "," \
   G_FILE_ATTRIBUTE_STANDARD_NAME "," \
@@ -49,22 +81,58 @@ typedef struct {
   GomAccountMinerJob *job;
 } SyncData;
 
+typedef struct {
+  gchar *url;
+  gchar *identifier;
+} UrlEntry;
+
+typedef struct {
+  GArray *urls;
+  GFile *root;
+  GHashTable *dir_urns;
+  GHashTable *stamps;
+  GomAccountMinerJob *job;
+  GomCrawler *crawler;
+  GomWebdav *webdav;
+  gboolean infinite_depth;
+} TraverseData;
+
+typedef struct {
+  GFile *dir;
+  GFileEnumerator *enumerator;
+  TraverseData *data;
+  gchar *urn;
+  guint depth;
+} ListingOp;
+
+static gchar *
+create_identifier (const gchar *uri,
+                   GFileType type)
+{
+  guint64 hash[2];
+
+  /* up to version 1 this was the MD5 of the URI */
+  gom_murmur_hash3_128 (uri, strlen (uri), 0, hash);
+
+  return g_strdup_printf ("%sowncloud:%016" G_GINT64_MODIFIER "x%016" G_GINT64_MODIFIER "x",
+                          (type == G_FILE_TYPE_DIRECTORY ? "gd:collection:" : ""),
+                          hash[0], hash[1]);
+}
+
 static gboolean
 account_miner_job_process_file (GomAccountMinerJob *job,
                                 GFile *file,
                                 GFileInfo *info,
-                                GFile *parent,
+                                const gchar *parent_urn,
+                                gchar **out_resource,
                                 GError **error)
 {
-  GChecksum *checksum = NULL;
-  GDateTime *modification_time;
   GFileType type;
   GTimeVal tv;
   gboolean mtime_changed;
   gboolean resource_exists;
   const gchar *class;
   const gchar *display_name;
-  const gchar *id;
   const gchar *name;
   gchar *identifier = NULL;
   gchar *resource = NULL;
@@ -73,15 +141,10 @@ account_miner_job_process_file (GomAccountMinerJob *job,
 
   type = g_file_info_get_file_type (info);
   uri = g_file_get_uri (file);
-
-  checksum = g_checksum_new (G_CHECKSUM_MD5);
-  g_checksum_update (checksum, uri, -1);
-  id = g_checksum_get_string (checksum);
-  identifier = g_strdup_printf ("%sowncloud:%s", (type == G_FILE_TYPE_DIRECTORY ? "gd:collection:" : ""), id);
-  g_checksum_reset (checksum);
+  identifier = create_identifier (uri, type);
 
   /* remove from the list of the previous resources */
-  g_hash_table_remove (job->previous_resources, identifier);
+  gom_account_miner_job_mark_processed (job, identifier);
 
   name = g_file_info_get_name (info);
   if (type == G_FILE_TYPE_REGULAR)
@@ -110,8 +173,7 @@ account_miner_job_process_file (GomAccountMinerJob *job,
     goto out;
 
   g_file_info_get_modification_time (info, &tv);
-  modification_time = g_date_time_new_from_timeval_local (&tv);
-  new_mtime = g_date_time_to_unix (modification_time);
+  new_mtime = tv.tv_sec;
   mtime_changed = gom_tracker_update_mtime (job->connection, new_mtime,
                                             resource_exists, identifier, resource,
                                             job->cancellable, error);
@@ -138,35 +200,14 @@ account_miner_job_process_file (GomAccountMinerJob *job,
   if (type == G_FILE_TYPE_REGULAR)
     {
       const gchar *mime;
-      const gchar *parent_id;
-      gchar *parent_identifier;
-      gchar *parent_resource_urn;
-      gchar *parent_uri;
 
-      if (parent != NULL)
+      if (parent_urn != NULL)
         {
-          parent_uri = g_file_get_uri (parent);
-          g_checksum_update (checksum, parent_uri, -1);
-          parent_id = g_checksum_get_string (checksum);
-          parent_identifier = g_strconcat ("gd:collection:owncloud:", parent_id, NULL);
-          parent_resource_urn = gom_tracker_sparql_connection_ensure_resource
-            (job->connection, job->cancellable, error,
-             NULL,
-             job->datasource_urn, parent_identifier,
-             "nfo:RemoteDataObject", "nfo:DataContainer", NULL);
-          g_checksum_reset (checksum);
-          g_free (parent_identifier);
-          g_free (parent_uri);
-
-          if (*error != NULL)
-            goto out;
-
           gom_tracker_sparql_connection_insert_or_replace_triple
             (job->connection,
              job->cancellable, error,
              job->datasource_urn, resource,
-             "nie:isPartOf", parent_resource_urn);
-          g_free (parent_resource_urn);
+             "nie:isPartOf", parent_urn);
 
           if (*error != NULL)
             goto out;
@@ -197,8 +238,12 @@ account_miner_job_process_file (GomAccountMinerJob *job,
     goto out;
 
  out:
-  if (checksum != NULL)
-    g_checksum_free (checksum);
+  if (*error == NULL && out_resource != NULL)
+    {
+      *out_resource = resource;
+      resource = NULL;
+    }
+
   g_free (identifier);
   g_free (resource);
   g_free (uri);
@@ -209,74 +254,608 @@ account_miner_job_process_file (GomAccountMinerJob *job,
   return TRUE;
 }
 
+static gint
+url_entry_compare (gconstpointer a,
+                   gconstpointer b)
+{
+  const UrlEntry *entry_a = a;
+  const UrlEntry *entry_b = b;
+
+  return strcmp (entry_a->url, entry_b->url);
+}
+
 static void
-account_miner_job_traverse_dir (GomAccountMinerJob *job,
-                                GFile *dir,
-                                gboolean is_root,
-                                GError **error)
+url_entry_clear (UrlEntry *entry)
 {
-  GError *local_error = NULL;
-  GFileEnumerator *enumerator;
-  GFileInfo *info;
-  gchar *dir_uri;
-
-  dir_uri = g_file_get_uri (dir);
-  enumerator = g_file_enumerate_children (dir,
-                                          FILE_ATTRIBUTES,
-                                          G_FILE_QUERY_INFO_NONE,
-                                          job->cancellable,
-                                          &local_error);
-  if (local_error != NULL)
-    goto out;
+  g_free (entry->url);
+  g_free (entry->identifier);
+}
 
-  while ((info = g_file_enumerator_next_file (enumerator, job->cancellable, &local_error)) != NULL)
+static void
+traverse_data_load_urls (TraverseData *data,
+                         GError **error)
+{
+  GomAccountMinerJob *job = data->job;
+  GString *select;
+  TrackerSparqlCursor *cursor;
+
+  select = g_string_new (NULL);
+  g_string_append_printf (select,
+                          "SELECT nie:url(?urn) nao:identifier(?urn) WHERE { ?urn nie:dataSource <%s> }",
+                          job->datasource_urn);
+
+  cursor = tracker_sparql_connection_query (job->connection,
+                                            select->str,
+                                            job->cancellable,
+                                            error);
+  g_string_free (select, TRUE);
+
+  if (cursor == NULL)
+    return;
+
+  while (tracker_sparql_cursor_next (cursor, job->cancellable, error))
     {
-      GFile *child;
-      GFileType type;
-      const gchar *name;
+      const gchar *identifier;
+      const gchar *url;
+      UrlEntry entry;
+
+      url = tracker_sparql_cursor_get_string (cursor, 0, NULL);
+      identifier = tracker_sparql_cursor_get_string (cursor, 1, NULL);
+      if (url == NULL || identifier == NULL)
+        continue;
+
+      entry.url = g_strdup (url);
+      entry.identifier = g_strdup (identifier);
+      g_array_append_val (data->urls, entry);
+    }
+
+  g_array_sort (data->urls, url_entry_compare);
+  g_object_unref (cursor);
+}
+
+/* Keep everything that is stored below @dir out of the cleanup, because
+ * it is not going to be visited.
+ */
+static void
+traverse_data_keep_subtree (TraverseData *data,
+                            GFile *dir)
+{
+  gchar *prefix;
+  gchar *uri;
+  guint high, low;
+
+  uri = g_file_get_uri (dir);
+  prefix = g_str_has_suffix (uri, "/") ? g_strdup (uri) : g_strconcat (uri, "/", NULL);
+
+  low = 0;
+  high = data->urls->len;
+  while (low < high)
+    {
+      guint mid = low + (high - low) / 2;
+
+      if (strcmp (g_array_index (data->urls, UrlEntry, mid).url, prefix) < 0)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+  for (; low < data->urls->len; low++)
+    {
+      UrlEntry *entry = &g_array_index (data->urls, UrlEntry, low);
+
+      if (!g_str_has_prefix (entry->url, prefix))
+        break;
+
+      gom_account_miner_job_mark_kept (data->job, entry->identifier);
+    }
+
+  g_free (prefix);
+  g_free (uri);
+}
+
+static gchar *
+file_info_get_stamp (GFileInfo *info)
+{
+  GTimeVal tv;
+  const gchar *etag;
+
+  etag = g_file_info_get_etag (info);
+  if (etag != NULL)
+    return g_strdup (etag);
+
+  g_file_info_get_modification_time (info, &tv);
+  return g_strdup_printf ("%ld", tv.tv_sec);
+}
+
+/* Returns TRUE if @dir has not changed since its subtree was last
+ * walked, in which case there is no need to descend into it.
+ */
+static gboolean
+traverse_data_check_dir (TraverseData *data,
+                         GFile *dir,
+                         GFileInfo *info)
+{
+  gboolean unchanged;
+  gchar *identifier;
+  gchar *key;
+  gchar *old_stamp;
+  gchar *stamp;
+  gchar *uri;
+
+  uri = g_file_get_uri (dir);
+  identifier = create_identifier (uri, G_FILE_TYPE_DIRECTORY);
+  key = g_strconcat (STATE_STAMP_PREFIX, identifier, NULL);
+
+  old_stamp = gom_account_miner_job_get_state (data->job, key);
+  stamp = file_info_get_stamp (info);
+  unchanged = (g_strcmp0 (old_stamp, stamp) == 0);
+
+  /* only committed once the whole traversal went through */
+  g_hash_table_insert (data->stamps, key, stamp);
+
+  if (unchanged)
+    {
+      g_debug ("Skipping unchanged directory %s", uri);
+      traverse_data_keep_subtree (data, dir);
+    }
+
+  g_free (old_stamp);
+  g_free (identifier);
+  g_free (uri);
+
+  return unchanged;
+}
+
+/* @dir could not be listed, so make sure that neither it nor any of
+ * its ancestors are skipped next time, and keep what we already know
+ * about its contents.
+ */
+static void
+traverse_data_invalidate_dir (TraverseData *data,
+                              GFile *dir)
+{
+  GFile *file;
+
+  traverse_data_keep_subtree (data, dir);
+
+  file = g_object_ref (dir);
+  while (file != NULL && !g_file_equal (file, data->root))
+    {
+      GFile *parent;
+      gchar *identifier;
+      gchar *key;
       gchar *uri;
 
-      type = g_file_info_get_file_type (info);
-      name = g_file_info_get_name (info);
-      child = g_file_get_child (dir, name);
+      uri = g_file_get_uri (file);
+      identifier = create_identifier (uri, G_FILE_TYPE_DIRECTORY);
+      key = g_strconcat (STATE_STAMP_PREFIX, identifier, NULL);
+
+      g_hash_table_remove (data->stamps, key);
+      gom_account_miner_job_set_state (data->job, key, NULL);
+
+      g_free (key);
+      g_free (identifier);
+      g_free (uri);
+
+      parent = g_file_get_parent (file);
+      g_object_unref (file);
+      file = parent;
+    }
+
+  g_clear_object (&file);
+}
+
+static void
+traverse_data_commit_stamps (TraverseData *data)
+{
+  GHashTableIter iter;
+  gpointer key, value;
 
-      if (type == G_FILE_TYPE_REGULAR || type == G_FILE_TYPE_DIRECTORY)
+  g_hash_table_iter_init (&iter, data->stamps);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    gom_account_miner_job_set_state (data->job, key, value);
+
+  /* drop the stamps of the directories that are about to be removed */
+  g_hash_table_iter_init (&iter, data->job->previous_resources);
+  while (g_hash_table_iter_next (&iter, &key, NULL))
+    {
+      gchar *stamp_key;
+
+      if (!g_str_has_prefix (key, "gd:collection:"))
+        continue;
+
+      stamp_key = g_strconcat (STATE_STAMP_PREFIX, key, NULL);
+      gom_account_miner_job_set_state (data->job, stamp_key, NULL);
+      g_free (stamp_key);
+    }
+}
+
+static ListingOp *
+listing_op_new (TraverseData *data,
+                GFile *dir,
+                const gchar *urn,
+                guint depth)
+{
+  ListingOp *op;
+
+  op = g_slice_new0 (ListingOp);
+  op->data = data;
+  op->dir = g_object_ref (dir);
+  op->urn = g_strdup (urn);
+  op->depth = depth;
+
+  return op;
+}
+
+static void
+listing_op_free (ListingOp *op)
+{
+  if (op->enumerator != NULL)
+    {
+      g_file_enumerator_close_async (op->enumerator, G_PRIORITY_DEFAULT, NULL, NULL, NULL);
+      g_object_unref (op->enumerator);
+    }
+
+  g_object_unref (op->dir);
+  g_free (op->urn);
+  g_slice_free (ListingOp, op);
+}
+
+/* returns the URN of @dir, without going through its metadata */
+static gchar *
+traverse_data_ensure_dir_urn (TraverseData *data,
+                              GFile *dir)
+{
+  GError *error = NULL;
+  gchar *identifier;
+  gchar *resource;
+  gchar *uri;
+
+  uri = g_file_get_uri (dir);
+  identifier = create_identifier (uri, G_FILE_TYPE_DIRECTORY);
+
+  resource = gom_tracker_sparql_connection_ensure_resource
+    (data->job->connection, data->job->cancellable, &error,
+     NULL,
+     data->job->datasource_urn, identifier,
+     "nfo:RemoteDataObject", "nfo:DataContainer", NULL);
+
+  if (error != NULL)
+    {
+      g_warning ("Unable to resolve %s: %s", uri, error->message);
+      g_error_free (error);
+    }
+
+  g_free (identifier);
+  g_free (uri);
+
+  return resource;
+}
+
+/* dir_urn is the URN of the directory containing child, or NULL for
+ * the root, and depth that of child; returns the URN of child, if it
+ * was processed
+ */
+static gchar *
+traverse_data_handle_child (TraverseData *data,
+                            const gchar *dir_urn,
+                            GFile *child,
+                            GFileInfo *info,
+                            guint depth)
+{
+  GError *error = NULL;
+  GFileType type;
+  gchar *resource = NULL;
+  gchar *uri;
+
+  type = g_file_info_get_file_type (info);
+
+  if (type == G_FILE_TYPE_REGULAR || type == G_FILE_TYPE_DIRECTORY)
+    {
+      account_miner_job_process_file (data->job, child, info, dir_urn, &resource, &error);
+      if (error != NULL)
         {
-          account_miner_job_process_file (job, child, info, is_root ? NULL : dir, &local_error);
-          if (local_error != NULL)
-            {
-              uri = g_file_get_uri (child);
-              g_warning ("Unable to process %s: %s", uri, local_error->message);
-              g_free (uri);
-              g_clear_error (&local_error);
-            }
+          uri = g_file_get_uri (child);
+          g_warning ("Unable to process %s: %s", uri, error->message);
+          g_free (uri);
+          g_clear_error (&error);
         }
+    }
 
-      if (type == G_FILE_TYPE_DIRECTORY)
+  if (type != G_FILE_TYPE_DIRECTORY)
+    return resource;
+
+  /* a Depth:infinity PROPFIND already returns the whole subtree, but
+   * the stamps are still worth recording for the next walk
+   */
+  if (traverse_data_check_dir (data, child, info) || data->infinite_depth)
+    return resource;
+
+  /* the children are still linked to child if processing it failed */
+  if (resource == NULL)
+    resource = traverse_data_ensure_dir_urn (data, child);
+
+  if (resource == NULL)
+    {
+      traverse_data_invalidate_dir (data, child);
+      return NULL;
+    }
+
+  /* what is not walked cannot be vouched for by the stamps */
+  if (!gom_crawler_add (data->crawler, listing_op_new (data, child, resource, depth), depth))
+    traverse_data_invalidate_dir (data, child);
+
+  return resource;
+}
+
+static void
+listing_op_finish (ListingOp *op,
+                   const GError *error)
+{
+  TraverseData *data = op->data;
+
+  if (error != NULL && !g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+    {
+      /* a directory that cannot be listed only fails the whole
+       * traversal if it is the root
+       */
+      if (op->dir == data->root)
+        gom_crawler_abort (data->crawler, error);
+      else
         {
-          account_miner_job_traverse_dir (job, child, FALSE, &local_error);
-          if (local_error != NULL)
-            {
-              uri = g_file_get_uri (child);
-              g_warning ("Unable to traverse %s: %s", uri, local_error->message);
-              g_free (uri);
-              g_clear_error (&local_error);
-            }
+          gchar *uri;
+
+          uri = g_file_get_uri (op->dir);
+          g_warning ("Unable to traverse %s: %s", uri, error->message);
+          g_free (uri);
+
+          traverse_data_invalidate_dir (data, op->dir);
         }
+    }
+
+  listing_op_free (op);
+  gom_crawler_done (data->crawler);
+}
+
+static void
+enumerator_next_files_cb (GObject *source_object,
+                          GAsyncResult *res,
+                          gpointer user_data)
+{
+  ListingOp *op = user_data;
+  TraverseData *data = op->data;
+  GError *error = NULL;
+  GList *infos, *l;
+
+  infos = g_file_enumerator_next_files_finish (op->enumerator, res, &error);
+  if (error != NULL || infos == NULL)
+    {
+      listing_op_finish (op, error);
+      g_clear_error (&error);
+      return;
+    }
+
+  for (l = infos; l != NULL; l = l->next)
+    {
+      GFileInfo *info = l->data;
+      GFile *child;
 
+      /* the children of op->dir all share its URN as their parent */
+      child = g_file_get_child (op->dir, g_file_info_get_name (info));
+      g_free (traverse_data_handle_child (data, op->urn, child, info, op->depth + 1));
       g_object_unref (child);
-      g_object_unref (info);
     }
 
-  if (local_error != NULL)
+  g_list_free_full (infos, g_object_unref);
+
+  g_file_enumerator_next_files_async (op->enumerator,
+                                      FILES_PER_BATCH,
+                                      G_PRIORITY_DEFAULT,
+                                      data->job->cancellable,
+                                      enumerator_next_files_cb,
+                                      op);
+}
+
+static void
+enumerate_children_cb (GObject *source_object,
+                       GAsyncResult *res,
+                       gpointer user_data)
+{
+  ListingOp *op = user_data;
+  GError *error = NULL;
+
+  op->enumerator = g_file_enumerate_children_finish (op->dir, res, &error);
+  if (error != NULL)
+    {
+      listing_op_finish (op, error);
+      g_error_free (error);
+      return;
+    }
+
+  g_file_enumerator_next_files_async (op->enumerator,
+                                      FILES_PER_BATCH,
+                                      G_PRIORITY_DEFAULT,
+                                      op->data->job->cancellable,
+                                      enumerator_next_files_cb,
+                                      op);
+}
+
+static const gchar *
+traverse_data_lookup_dir_urn (TraverseData *data,
+                              const gchar *path)
+{
+  GFile *dir;
+  gchar *resource;
+
+  resource = g_hash_table_lookup (data->dir_urns, path);
+  if (resource != NULL)
+    return resource;
+
+  /* a multistatus is not required to list a collection before its
+   * members
+   */
+  dir = g_file_resolve_relative_path (data->root, path);
+  resource = traverse_data_ensure_dir_urn (data, dir);
+  if (resource != NULL)
+    g_hash_table_insert (data->dir_urns, g_strdup (path), resource);
+
+  g_object_unref (dir);
+
+  return resource;
+}
+
+static void
+webdav_entry_cb (const gchar *path,
+                 GFileInfo *info,
+                 gpointer user_data)
+{
+  ListingOp *op = user_data;
+  TraverseData *data = op->data;
+  GFile *child;
+  const gchar *parent_urn;
+  gchar *resource;
+
+  child = g_file_resolve_relative_path (data->root, path);
+
+  if (!data->infinite_depth)
+    {
+      resource = traverse_data_handle_child (data, op->urn, child, info, op->depth + 1);
+      g_free (resource);
+    }
+  else
+    {
+      gchar *dirname;
+
+      /* the whole tree comes in one response, so the URNs of the
+       * directories are remembered until their members show up
+       */
+      if (strchr (path, '/') != NULL)
+        {
+          dirname = g_path_get_dirname (path);
+          parent_urn = traverse_data_lookup_dir_urn (data, dirname);
+          g_free (dirname);
+        }
+      else
+        parent_urn = NULL;
+
+      resource = traverse_data_handle_child (data, parent_urn, child, info, 0);
+      if (resource != NULL && g_file_info_get_file_type (info) == G_FILE_TYPE_DIRECTORY)
+        g_hash_table_replace (data->dir_urns, g_strdup (path), resource);
+      else
+        g_free (resource);
+    }
+
+  g_object_unref (child);
+}
+
+static void
+webdav_propfind_cb (GObject *source_object,
+                    GAsyncResult *res,
+                    gpointer user_data)
+{
+  ListingOp *op = user_data;
+  TraverseData *data = op->data;
+  GError *error = NULL;
+
+  gom_webdav_propfind_finish (data->webdav, res, &error);
+
+  /* servers are free to refuse walking the whole tree in one go */
+  if (data->infinite_depth && g_error_matches (error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED))
+    {
+      g_debug ("Falling back to Depth:1 PROPFINDs: %s", error->message);
+      g_clear_error (&error);
+
+      data->infinite_depth = FALSE;
+      gom_crawler_add (data->crawler, listing_op_new (data, data->root, NULL, 0), 0);
+    }
+
+  listing_op_finish (op, error);
+  g_clear_error (&error);
+}
+
+static void
+traverse_data_list (GomCrawler *crawler,
+                    gpointer node,
+                    guint depth,
+                    gpointer user_data)
+{
+  ListingOp *op = node;
+  TraverseData *data = user_data;
+  GomAccountMinerJob *job = data->job;
+
+  if (data->webdav != NULL)
+    {
+      gchar *path;
+
+      path = g_file_get_relative_path (data->root, op->dir);
+      gom_webdav_propfind_async (data->webdav,
+                                 path,
+                                 data->infinite_depth,
+                                 job->cancellable,
+                                 webdav_entry_cb,
+                                 op,
+                                 webdav_propfind_cb,
+                                 op);
+      g_free (path);
+    }
+  else
+    {
+      g_file_enumerate_children_async (op->dir,
+                                       FILE_ATTRIBUTES,
+                                       G_FILE_QUERY_INFO_NONE,
+                                       G_PRIORITY_DEFAULT,
+                                       job->cancellable,
+                                       enumerate_children_cb,
+                                       op);
+    }
+}
+
+static void
+account_miner_job_traverse (GomAccountMinerJob *job,
+                            GFile *root,
+                            GomWebdav *webdav,
+                            GError **error)
+{
+  GomOwncloudMiner *self = GOM_OWNCLOUD_MINER (job->miner);
+  GMainContext *context;
+  TraverseData data;
+
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  data.job = job;
+  data.root = root;
+  data.webdav = webdav;
+  data.infinite_depth = (webdav != NULL && self->priv->webdav_infinite_depth);
+  data.crawler = gom_crawler_new (self->priv->max_listings,
+                                  self->priv->max_depth,
+                                  traverse_data_list,
+                                  (GDestroyNotify) listing_op_free,
+                                  &data,
+                                  job->cancellable);
+  data.stamps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  data.dir_urns = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  data.urls = g_array_new (FALSE, FALSE, sizeof (UrlEntry));
+  g_array_set_clear_func (data.urls, (GDestroyNotify) url_entry_clear);
+
+  /* the URLs of everything we know about, to find what is below a
+   * directory that does not need to be walked again
+   */
+  traverse_data_load_urls (&data, error);
+  if (*error != NULL)
     goto out;
 
- out:
-  if (local_error != NULL)
-    g_propagate_error (error, local_error);
+  gom_crawler_add (data.crawler, listing_op_new (&data, root, NULL, 0), 0);
+  if (gom_crawler_run (data.crawler, error))
+    traverse_data_commit_stamps (&data);
 
-  g_clear_object (&enumerator);
-  g_free (dir_uri);
+ out:
+  g_array_unref (data.urls);
+  g_hash_table_unref (data.dir_urns);
+  g_hash_table_unref (data.stamps);
+  gom_crawler_free (data.crawler);
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
 }
 
 static gboolean
@@ -329,6 +908,50 @@ volume_mount_cb (GObject *source_object, GAsyncResult *res, gpointer user_data)
   g_main_loop_quit (data->loop);
 }
 
+static void
+account_miner_job_traverse_webdav (GomAccountMinerJob *job,
+                                   GError **error)
+{
+  GomOwncloudMiner *self = GOM_OWNCLOUD_MINER (job->miner);
+  GFile *root = NULL;
+  GoaAccount *account;
+  GoaPasswordBased *password_based;
+  GomWebdav *webdav = NULL;
+  const gchar *uri;
+  gchar *password = NULL;
+
+  account = goa_object_peek_account (GOA_OBJECT (job->service));
+  password_based = goa_object_peek_password_based (GOA_OBJECT (job->service));
+
+  /* lets the crawler be pointed at a local WebDAV server */
+  uri = g_getenv ("OWNCLOUD_MINER_WEBDAV_URI");
+  if (uri == NULL)
+    uri = goa_files_get_uri (goa_object_peek_files (GOA_OBJECT (job->service)));
+
+  if (password_based != NULL)
+    {
+      goa_password_based_call_get_password_sync (password_based, "", &password, job->cancellable, error);
+      if (*error != NULL)
+        goto out;
+    }
+
+  webdav = gom_webdav_new (uri,
+                           goa_account_get_identity (account),
+                           password,
+                           self->priv->max_listings,
+                           error);
+  if (*error != NULL)
+    goto out;
+
+  root = g_file_new_for_uri (uri);
+  account_miner_job_traverse (job, root, webdav, error);
+
+ out:
+  g_clear_object (&root);
+  g_clear_pointer (&webdav, gom_webdav_free);
+  g_free (password);
+}
+
 static void
 query_owncloud (GomAccountMinerJob *job,
                 GError **error)
@@ -344,6 +967,12 @@ query_owncloud (GomAccountMinerJob *job,
   SyncData data;
   gboolean found = FALSE;
 
+  if (priv->webdav)
+    {
+      account_miner_job_traverse_webdav (job, error);
+      return;
+    }
+
   data.job = job;
   volumes = g_volume_monitor_get_volumes (priv->monitor);
 
@@ -395,7 +1024,7 @@ query_owncloud (GomAccountMinerJob *job,
     }
 
   root = g_mount_get_root (mount);
-  account_miner_job_traverse_dir (job, root, TRUE, error);
+  account_miner_job_traverse (job, root, NULL, error);
 
   g_object_unref (root);
   g_object_unref (mount);
@@ -419,11 +1048,106 @@ gom_owncloud_miner_dispose (GObject *object)
   G_OBJECT_CLASS (gom_owncloud_miner_parent_class)->dispose (object);
 }
 
+static void
+migrate_owncloud (GomAccountMinerJob *job,
+                  gint old_version,
+                  GError **error)
+{
+  GString *update = NULL;
+  TrackerSparqlCursor *cursor = NULL;
+  gchar *select;
+  guint n_pending = 0;
+
+  /* the identifiers are recomputed from the stored URLs, so that the
+   * resources keep their URNs
+   */
+  select = g_strdup_printf ("SELECT ?urn nie:url(?urn) nao:identifier(?urn) "
+                            "WHERE { ?urn nie:dataSource <%s> }",
+                            job->datasource_urn);
+
+  cursor = tracker_sparql_connection_query (job->connection, select, job->cancellable, error);
+  g_free (select);
+
+  if (*error != NULL)
+    goto out;
+
+  update = g_string_new (NULL);
+
+  while (tracker_sparql_cursor_next (cursor, job->cancellable, error))
+    {
+      const gchar *old_identifier;
+      const gchar *url;
+      const gchar *urn;
+      gchar *identifier;
+
+      urn = tracker_sparql_cursor_get_string (cursor, 0, NULL);
+      url = tracker_sparql_cursor_get_string (cursor, 1, NULL);
+      old_identifier = tracker_sparql_cursor_get_string (cursor, 2, NULL);
+
+      /* anything without a URL is not found again, and is cleaned up
+       * after the next query
+       */
+      if (url == NULL || old_identifier == NULL)
+        continue;
+
+      identifier = create_identifier (url,
+                                      g_str_has_prefix (old_identifier, "gd:collection:") ?
+                                      G_FILE_TYPE_DIRECTORY : G_FILE_TYPE_REGULAR);
+
+      g_string_append_printf (update,
+                              "DELETE { <%s> nao:identifier \"%s\" } "
+                              "INSERT INTO <%s> { <%s> nao:identifier \"%s\" } ",
+                              urn, old_identifier,
+                              job->datasource_urn, urn, identifier);
+      g_free (identifier);
+
+      if (++n_pending < MIGRATE_BATCH_SIZE)
+        continue;
+
+      tracker_sparql_connection_update (job->connection, update->str, G_PRIORITY_DEFAULT, job->cancellable, error);
+      if (*error != NULL)
+        goto out;
+
+      g_string_truncate (update, 0);
+      n_pending = 0;
+    }
+
+  if (*error != NULL || n_pending == 0)
+    goto out;
+
+  tracker_sparql_connection_update (job->connection, update->str, G_PRIORITY_DEFAULT, job->cancellable, error);
+
+ out:
+  if (update != NULL)
+    g_string_free (update, TRUE);
+
+  g_clear_object (&cursor);
+}
+
 static void
 gom_owncloud_miner_init (GomOwncloudMiner *self)
 {
+  const gchar *max_depth;
+  const gchar *max_listings;
+
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, GOM_TYPE_OWNCLOUD_MINER, GomOwncloudMinerPrivate);
   self->priv->monitor = g_volume_monitor_get ();
+  self->priv->max_listings = DEFAULT_MAX_LISTINGS;
+  self->priv->max_depth = DEFAULT_MAX_DEPTH;
+
+  max_listings = g_getenv ("OWNCLOUD_MINER_MAX_LISTINGS");
+  if (max_listings != NULL)
+    self->priv->max_listings = MAX (1, g_ascii_strtoull (max_listings, NULL, 10));
+
+  max_depth = g_getenv ("OWNCLOUD_MINER_MAX_DEPTH");
+  if (max_depth != NULL)
+    self->priv->max_depth = g_ascii_strtoull (max_depth, NULL, 10);
+
+  /* talk PROPFIND to the server directly instead of going through the
+   * GVfs mount, optionally asking for the whole tree at once
+   */
+  self->priv->webdav = (g_getenv ("OWNCLOUD_MINER_WEBDAV") != NULL);
+  self->priv->webdav_infinite_depth = (g_strcmp0 (g_getenv ("OWNCLOUD_MINER_WEBDAV_DEPTH"), "infinity") == 0);
 }
 
 static void
@@ -436,10 +1160,11 @@ gom_owncloud_miner_class_init (GomOwncloudMinerClass *klass)
 
   miner_class->goa_provider_type = "owncloud";
   miner_class->miner_identifier = MINER_IDENTIFIER;
-  miner_class->version = 1;
+  miner_class->version = 2;
 
   miner_class->create_service = create_service;
   miner_class->query = query_owncloud;
+  miner_class->migrate = migrate_owncloud;
 
   g_type_class_add_private (klass, sizeof (GomOwncloudMinerPrivate));
 }
@@ -444,10 +444,10 @@ gom_tracker_update_mtime (TrackerSparqlConnection  *connection,
                           GCancellable             *cancellable,
                           GError                  **error)
 {
-  GTimeVal old_mtime;
   gboolean res;
+  gchar date[GOM_ISO8601_SIZE];
   gchar *old_value;
-  gchar *date;
+  gint64 old_mtime;
 
   if (resource_exists)
     {
@@ -458,20 +458,18 @@ gom_tracker_update_mtime (TrackerSparqlConnection  *connection,
 
       if (res)
         {
-          res = g_time_val_from_iso8601 (old_value, &old_mtime);
+          res = gom_iso8601_parse (old_value, &old_mtime);
           g_free (old_value);
         }
 
-      if (res && (new_mtime == old_mtime.tv_sec))
+      if (res && (new_mtime == old_mtime))
         return FALSE;
     }
 
-  date = gom_iso8601_from_timestamp (new_mtime);
   gom_tracker_sparql_connection_insert_or_replace_triple
     (connection, cancellable, error,
      identifier, resource,
-     "nie:contentLastModified", date);
-  g_free (date);
+     "nie:contentLastModified", gom_iso8601_format (new_mtime, date));
 
   return TRUE;
 }
@@ -0,0 +1,204 @@
+/*
+ * GNOME Online Miners - crawls through your online content
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+/* times gom_filename_lookup_type against the chain of g_strcmp0 calls
+ * it replaced; run as gom-utils-bench [ROUNDS]
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "gom-utils.h"
+
+#define DEFAULT_ROUNDS 100000
+
+/* a mix of what the miners come across: office documents, photos,
+ * compressed files and names the table does not know
+ */
+static const gchar *filenames[] = {
+  "Report.docx",
+  "Budget 2014.xlsx",
+  "slides.pptx",
+  "thesis.pdf",
+  "notes.txt",
+  "index.html",
+  "IMG_0042.JPG",
+  "IMG_0043.jpg",
+  "holiday.jpeg",
+  "screenshot.png",
+  "animation.gif",
+  "minutes.odt",
+  "accounts.ods",
+  "talk.odp",
+  "book.epub",
+  "letter.doc",
+  "old-budget.xls",
+  "old-slides.ppt",
+  "backup.tar.gz",
+  "archive.zip",
+  "song.mp3",
+  "video.mp4",
+  "README",
+  ".hidden",
+};
+
+/* the implementation before the extension table, unchanged, ".txt"
+ * bug included
+ */
+static const char *
+old_get_extension_offset (const char *filename)
+{
+	char *end, *end2;
+
+	end = strrchr (filename, '.');
+
+	if (end && end != filename) {
+		if (strcmp (end, ".gz") == 0 ||
+		    strcmp (end, ".bz2") == 0 ||
+		    strcmp (end, ".sit") == 0 ||
+		    strcmp (end, ".Z") == 0) {
+			end2 = end - 1;
+			while (end2 > filename &&
+			       *end2 != '.') {
+				end2--;
+			}
+			if (end2 != filename) {
+				end = end2;
+			}
+		}
+	}
+
+	return end;
+}
+
+static const gchar *
+old_filename_to_rdf_type (const gchar *filename_with_extension)
+{
+  const gchar *extension;
+  const gchar *type = NULL;
+
+  extension = old_get_extension_offset (filename_with_extension);
+
+  if (g_strcmp0 (extension, ".txt") == 0)
+    type = "nfo:HtmlDocument";
+
+  else if (g_strcmp0 (extension, ".doc") == 0
+      || g_strcmp0 (extension, ".docm") == 0
+      || g_strcmp0 (extension, ".docx") == 0
+      || g_strcmp0 (extension, ".dot") == 0
+      || g_strcmp0 (extension, ".dotx") == 0
+      || g_strcmp0 (extension, ".epub") == 0
+      || g_strcmp0 (extension, ".odt") == 0
+      || g_strcmp0 (extension, ".pdf") == 0)
+    type = "nfo:PaginatedTextDocument";
+
+  else if (g_strcmp0 (extension, ".odp") == 0
+           || g_strcmp0 (extension, ".pot") == 0
+           || g_strcmp0 (extension, ".potm") == 0
+           || g_strcmp0 (extension, ".potx") == 0
+           || g_strcmp0 (extension, ".pps") == 0
+           || g_strcmp0 (extension, ".ppsm") == 0
+           || g_strcmp0 (extension, ".ppsx") == 0
+           || g_strcmp0 (extension, ".ppt") == 0
+           || g_strcmp0 (extension, ".pptm") == 0
+           || g_strcmp0 (extension, ".pptx") == 0)
+    type = "nfo:Presentation";
+
+  else if (g_strcmp0 (extension, ".txt") == 0)
+    type = "nfo:PlainTextDocument";
+
+  else if (g_strcmp0 (extension, ".ods") == 0
+           || g_strcmp0 (extension, ".xls") == 0
+           || g_strcmp0 (extension, ".xlsb") == 0
+           || g_strcmp0 (extension, ".xlsm") == 0
+           || g_strcmp0 (extension, ".xlsx") == 0)
+    type = "nfo:Spreadsheet";
+
+  return type;
+}
+
+static const gchar *
+new_filename_to_rdf_type (const gchar *filename_with_extension)
+{
+  const gchar *rdf_type;
+
+  gom_filename_lookup_type (filename_with_extension, &rdf_type, NULL);
+  return rdf_type;
+}
+
+/* returns the nanoseconds per lookup; found keeps the compiler from
+ * dropping the calls
+ */
+static gdouble
+time_lookups (const gchar *(*lookup) (const gchar *),
+              guint rounds,
+              guint *found)
+{
+  gint64 start;
+  guint idx;
+  guint round;
+
+  *found = 0;
+  start = g_get_monotonic_time ();
+
+  for (round = 0; round < rounds; round++)
+    {
+      for (idx = 0; idx < G_N_ELEMENTS (filenames); idx++)
+        {
+          if (lookup (filenames[idx]) != NULL)
+            (*found)++;
+        }
+    }
+
+  return (gdouble) (g_get_monotonic_time () - start) * 1000.0
+    / ((gdouble) rounds * G_N_ELEMENTS (filenames));
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  gdouble new_ns;
+  gdouble old_ns;
+  guint new_found;
+  guint old_found;
+  guint rounds = DEFAULT_ROUNDS;
+
+  if (argc > 1)
+    rounds = MAX ((guint) g_ascii_strtoull (argv[1], NULL, 10), 1);
+
+  /* warm up the caches before measuring either */
+  time_lookups (old_filename_to_rdf_type, 1, &old_found);
+  time_lookups (new_filename_to_rdf_type, 1, &new_found);
+
+  old_ns = time_lookups (old_filename_to_rdf_type, rounds, &old_found);
+  new_ns = time_lookups (new_filename_to_rdf_type, rounds, &new_found);
+
+  g_print ("%u file names, %u rounds\n", (guint) G_N_ELEMENTS (filenames), rounds);
+  g_print ("g_strcmp0 chain:   %8.1f ns per lookup (%u found)\n", old_ns, old_found);
+  g_print ("extension table:   %8.1f ns per lookup (%u found)\n", new_ns, new_found);
+
+  return 0;
+}
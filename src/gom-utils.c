@@ -21,6 +21,7 @@
  *
  */
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "gom-utils.h"
@@ -51,60 +52,394 @@ gom_filename_get_extension_offset (const char *filename)
 	return end;
 }
 
-const gchar *
-gom_filename_to_rdf_type (const gchar *filename_with_extension)
+typedef struct {
+  const gchar *extension;
+  const gchar *rdf_type;
+  const gchar *mime_type;
+} GomExtensionType;
+
+/* keep sorted by extension, in strcmp order, for bsearch; images only
+ * carry a MIME type since they are not documents
+ */
+static const GomExtensionType extension_types[] = {
+  { ".doc", "nfo:PaginatedTextDocument", "application/msword" },
+  { ".docm", "nfo:PaginatedTextDocument", "application/vnd.ms-word.document.macroEnabled.12" },
+  { ".docx", "nfo:PaginatedTextDocument", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+  { ".dot", "nfo:PaginatedTextDocument", "application/msword-template" },
+  { ".dotx", "nfo:PaginatedTextDocument", "application/vnd.openxmlformats-officedocument.wordprocessingml.template" },
+  { ".epub", "nfo:PaginatedTextDocument", "application/epub+zip" },
+  { ".gif", NULL, "image/gif" },
+  { ".html", "nfo:HtmlDocument", "text/html" },
+  { ".jpeg", NULL, "image/jpeg" },
+  { ".jpg", NULL, "image/jpeg" },
+  { ".odp", "nfo:Presentation", "application/vnd.oasis.opendocument.presentation" },
+  { ".ods", "nfo:Spreadsheet", "application/vnd.oasis.opendocument.spreadsheet" },
+  { ".odt", "nfo:PaginatedTextDocument", "application/vnd.oasis.opendocument.text" },
+  { ".pdf", "nfo:PaginatedTextDocument", "application/pdf" },
+  { ".png", NULL, "image/png" },
+  { ".pot", "nfo:Presentation", "application/vnd.ms-powerpoint" },
+  { ".potm", "nfo:Presentation", "application/vnd.ms-powerpoint.template.macroEnabled.12" },
+  { ".potx", "nfo:Presentation", "application/vnd.openxmlformats-officedocument.presentationml.template" },
+  { ".pps", "nfo:Presentation", "application/vnd.ms-powerpoint" },
+  { ".ppsm", "nfo:Presentation", "application/vnd.ms-powerpoint.slideshow.macroEnabled.12" },
+  { ".ppsx", "nfo:Presentation", "application/vnd.openxmlformats-officedocument.presentationml.slideshow" },
+  { ".ppt", "nfo:Presentation", "application/vnd.ms-powerpoint" },
+  { ".pptm", "nfo:Presentation", "application/vnd.ms-powerpoint.presentation.macroEnabled.12" },
+  { ".pptx", "nfo:Presentation", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+  { ".txt", "nfo:PlainTextDocument", "text/plain" },
+  { ".xls", "nfo:Spreadsheet", "application/vnd.ms-excel" },
+  { ".xlsb", "nfo:Spreadsheet", "application/vnd.ms-excel.sheet.binary.macroEnabled.12" },
+  { ".xlsm", "nfo:Spreadsheet", "application/vnd.ms-excel.sheet.macroEnabled.12" },
+  { ".xlsx", "nfo:Spreadsheet", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" }
+};
+
+static gint
+extension_type_compare (gconstpointer key,
+                        gconstpointer member)
+{
+  const GomExtensionType *type = member;
+
+  return strcmp (key, type->extension);
+}
+
+/* looks the extension of the file name up, returning FALSE if it is
+ * not known; either of rdf_type and mime_type can be NULL
+ */
+gboolean
+gom_filename_lookup_type (const gchar *filename_with_extension,
+                          const gchar **rdf_type,
+                          const gchar **mime_type)
 {
+  const GomExtensionType *type = NULL;
   const gchar *extension;
-  const gchar *type = NULL;
 
-  g_return_val_if_fail (filename_with_extension != NULL, NULL);
+  g_return_val_if_fail (filename_with_extension != NULL, FALSE);
 
   extension = gom_filename_get_extension_offset (filename_with_extension);
+  if (extension != NULL)
+    type = bsearch (extension,
+                    extension_types,
+                    G_N_ELEMENTS (extension_types),
+                    sizeof (extension_types[0]),
+                    extension_type_compare);
+
+  if (rdf_type != NULL)
+    *rdf_type = (type != NULL) ? type->rdf_type : NULL;
+
+  if (mime_type != NULL)
+    *mime_type = (type != NULL) ? type->mime_type : NULL;
 
-  if (g_strcmp0 (extension, ".txt") == 0)
-    type = "nfo:HtmlDocument";
-
-  else if (g_strcmp0 (extension, ".doc") == 0
-      || g_strcmp0 (extension, ".docm") == 0
-      || g_strcmp0 (extension, ".docx") == 0
-      || g_strcmp0 (extension, ".dot") == 0
-      || g_strcmp0 (extension, ".dotx") == 0
-      || g_strcmp0 (extension, ".epub") == 0
-      || g_strcmp0 (extension, ".odt") == 0
-      || g_strcmp0 (extension, ".pdf") == 0)
-    type = "nfo:PaginatedTextDocument";
-
-  else if (g_strcmp0 (extension, ".odp") == 0
-           || g_strcmp0 (extension, ".pot") == 0
-           || g_strcmp0 (extension, ".potm") == 0
-           || g_strcmp0 (extension, ".potx") == 0
-           || g_strcmp0 (extension, ".pps") == 0
-           || g_strcmp0 (extension, ".ppsm") == 0
-           || g_strcmp0 (extension, ".ppsx") == 0
-           || g_strcmp0 (extension, ".ppt") == 0
-           || g_strcmp0 (extension, ".pptm") == 0
-           || g_strcmp0 (extension, ".pptx") == 0)
-    type = "nfo:Presentation";
-
-  else if (g_strcmp0 (extension, ".txt") == 0)
-    type = "nfo:PlainTextDocument";
-
-  else if (g_strcmp0 (extension, ".ods") == 0
-           || g_strcmp0 (extension, ".xls") == 0
-           || g_strcmp0 (extension, ".xlsb") == 0
-           || g_strcmp0 (extension, ".xlsm") == 0
-           || g_strcmp0 (extension, ".xlsx") == 0)
-    type = "nfo:Spreadsheet";
+  return (type != NULL);
+}
 
+const gchar *
+gom_filename_to_rdf_type (const gchar *filename_with_extension)
+{
+  const gchar *type;
+
+  g_return_val_if_fail (filename_with_extension != NULL, NULL);
+
+  gom_filename_lookup_type (filename_with_extension, &type, NULL);
   return type;
 }
 
-gchar *
-gom_iso8601_from_timestamp (gint64 timestamp)
+/* days since 1970-01-01 in the proleptic Gregorian calendar, and back;
+ * see http://howardhinnant.github.io/date_algorithms.html
+ */
+static gint64
+days_from_civil (gint64 year,
+                 gint month,
+                 gint day)
+{
+  gint64 era;
+  gint64 day_of_era;
+  gint64 day_of_year;
+  gint64 year_of_era;
+
+  year -= (month <= 2);
+  era = (year >= 0 ? year : year - 399) / 400;
+  year_of_era = year - era * 400;
+  day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+  day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+  return era * 146097 + day_of_era - 719468;
+}
+
+static void
+civil_from_days (gint64 days,
+                 gint64 *year,
+                 gint *month,
+                 gint *day)
+{
+  gint64 era;
+  gint64 day_of_era;
+  gint64 day_of_year;
+  gint64 year_of_era;
+  gint64 mp;
+
+  days += 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  day_of_era = days - era * 146097;
+  year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+  day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+  mp = (5 * day_of_year + 2) / 153;
+
+  *day = day_of_year - (153 * mp + 2) / 5 + 1;
+  *month = mp < 10 ? mp + 3 : mp - 9;
+  *year = year_of_era + era * 400 + (*month <= 2);
+}
+
+/* formats timestamp the way g_time_val_to_iso8601 does for whole
+ * seconds, "YYYY-MM-DDTHH:MM:SSZ", into buffer and returns it
+ */
+const gchar *
+gom_iso8601_format (gint64 timestamp,
+                    gchar buffer[GOM_ISO8601_SIZE])
+{
+  gint64 days;
+  gint64 seconds;
+  gint64 year;
+  gint day;
+  gint month;
+
+  days = timestamp / 86400;
+  seconds = timestamp % 86400;
+  if (seconds < 0)
+    {
+      seconds += 86400;
+      days--;
+    }
+
+  civil_from_days (days, &year, &month, &day);
+
+  g_snprintf (buffer, GOM_ISO8601_SIZE,
+              "%04" G_GINT64_FORMAT "-%02d-%02dT%02d:%02d:%02dZ",
+              year, month, day,
+              (gint) (seconds / 3600), (gint) (seconds / 60 % 60), (gint) (seconds % 60));
+
+  return buffer;
+}
+
+static gboolean
+parse_digits (const gchar **str,
+              guint n_digits,
+              gint *value)
+{
+  const gchar *p = *str;
+  guint i;
+
+  *value = 0;
+  for (i = 0; i < n_digits; i++)
+    {
+      if (!g_ascii_isdigit (p[i]))
+        return FALSE;
+
+      *value = *value * 10 + (p[i] - '0');
+    }
+
+  *str = p + n_digits;
+  return TRUE;
+}
+
+/* the extended format with an explicit time zone, as written by
+ * Tracker and the web services, is parsed here without allocating;
+ * anything else is left to g_time_val_from_iso8601
+ */
+gboolean
+gom_iso8601_parse (const gchar *iso8601,
+                   gint64 *timestamp)
 {
   GTimeVal tv;
+  const gchar *p = iso8601;
+  gint day, hour, minute, month, second, year;
+  gint offset = 0;
+
+  g_return_val_if_fail (iso8601 != NULL, FALSE);
+
+  if (!parse_digits (&p, 4, &year) || *p++ != '-'
+      || !parse_digits (&p, 2, &month) || *p++ != '-'
+      || !parse_digits (&p, 2, &day))
+    goto fallback;
+
+  if (*p != 'T' && *p != 't' && *p != ' ')
+    goto fallback;
+
+  p++;
+  if (!parse_digits (&p, 2, &hour) || *p++ != ':'
+      || !parse_digits (&p, 2, &minute) || *p++ != ':'
+      || !parse_digits (&p, 2, &second))
+    goto fallback;
+
+  if (month < 1 || month > 12 || day < 1 || day > 31
+      || hour > 23 || minute > 59 || second > 60)
+    goto fallback;
+
+  /* fractions of a second are dropped */
+  if (*p == '.' || *p == ',')
+    {
+      p++;
+      if (!g_ascii_isdigit (*p))
+        goto fallback;
+
+      while (g_ascii_isdigit (*p))
+        p++;
+    }
+
+  if (*p == 'Z' || *p == 'z')
+    p++;
+  else if (*p == '+' || *p == '-')
+    {
+      gint offset_hours, offset_minutes = 0;
+      gint sign = (*p == '-') ? -1 : 1;
+
+      p++;
+      if (!parse_digits (&p, 2, &offset_hours))
+        goto fallback;
+
+      if (*p == ':')
+        p++;
+
+      if (*p != '\0' && !parse_digits (&p, 2, &offset_minutes))
+        goto fallback;
+
+      offset = sign * (offset_hours * 3600 + offset_minutes * 60);
+    }
+  else
+    goto fallback;
+
+  if (*p != '\0')
+    goto fallback;
+
+  *timestamp = days_from_civil (year, month, day) * 86400
+    + hour * 3600 + minute * 60 + second - offset;
+  return TRUE;
+
+ fallback:
+  /* no time zone means local time to GLib */
+  if (!g_time_val_from_iso8601 (iso8601, &tv))
+    return FALSE;
+
+  *timestamp = tv.tv_sec;
+  return TRUE;
+}
+
+static inline guint64
+rotl64 (guint64 x,
+        gint r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+fmix64 (guint64 k)
+{
+  k ^= k >> 33;
+  k *= G_GUINT64_CONSTANT (0xff51afd7ed558ccd);
+  k ^= k >> 33;
+  k *= G_GUINT64_CONSTANT (0xc4ceb9fe1a85ec53);
+  k ^= k >> 33;
+
+  return k;
+}
+
+/* MurmurHash3_x64_128 by Austin Appleby, which is in the public
+ * domain; blocks are read as little-endian so that the result does not
+ * depend on the host
+ */
+void
+gom_murmur_hash3_128 (gconstpointer key,
+                      gsize length,
+                      guint32 seed,
+                      guint64 hash[2])
+{
+  const guint8 *data = key;
+  const guint8 *tail;
+  const guint64 c1 = G_GUINT64_CONSTANT (0x87c37b91114253d5);
+  const guint64 c2 = G_GUINT64_CONSTANT (0x4cf5ad432745937f);
+  gsize i;
+  gsize n_blocks = length / 16;
+  guint64 h1 = seed;
+  guint64 h2 = seed;
+  guint64 k1;
+  guint64 k2;
+
+  for (i = 0; i < n_blocks; i++)
+    {
+      memcpy (&k1, data + i * 16, sizeof (k1));
+      memcpy (&k2, data + i * 16 + 8, sizeof (k2));
+      k1 = GUINT64_FROM_LE (k1);
+      k2 = GUINT64_FROM_LE (k2);
+
+      k1 *= c1;
+      k1 = rotl64 (k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+
+      h1 = rotl64 (h1, 27);
+      h1 += h2;
+      h1 = h1 * 5 + 0x52dce729;
+
+      k2 *= c2;
+      k2 = rotl64 (k2, 33);
+      k2 *= c1;
+      h2 ^= k2;
+
+      h2 = rotl64 (h2, 31);
+      h2 += h1;
+      h2 = h2 * 5 + 0x38495ab5;
+    }
+
+  tail = data + n_blocks * 16;
+  k1 = 0;
+  k2 = 0;
+
+  switch (length & 15)
+    {
+    case 15: k2 ^= ((guint64) tail[14]) << 48; /* fall through */
+    case 14: k2 ^= ((guint64) tail[13]) << 40; /* fall through */
+    case 13: k2 ^= ((guint64) tail[12]) << 32; /* fall through */
+    case 12: k2 ^= ((guint64) tail[11]) << 24; /* fall through */
+    case 11: k2 ^= ((guint64) tail[10]) << 16; /* fall through */
+    case 10: k2 ^= ((guint64) tail[9]) << 8; /* fall through */
+    case 9:
+      k2 ^= ((guint64) tail[8]);
+      k2 *= c2;
+      k2 = rotl64 (k2, 33);
+      k2 *= c1;
+      h2 ^= k2;
+      /* fall through */
+
+    case 8: k1 ^= ((guint64) tail[7]) << 56; /* fall through */
+    case 7: k1 ^= ((guint64) tail[6]) << 48; /* fall through */
+    case 6: k1 ^= ((guint64) tail[5]) << 40; /* fall through */
+    case 5: k1 ^= ((guint64) tail[4]) << 32; /* fall through */
+    case 4: k1 ^= ((guint64) tail[3]) << 24; /* fall through */
+    case 3: k1 ^= ((guint64) tail[2]) << 16; /* fall through */
+    case 2: k1 ^= ((guint64) tail[1]) << 8; /* fall through */
+    case 1:
+      k1 ^= ((guint64) tail[0]);
+      k1 *= c1;
+      k1 = rotl64 (k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+      break;
+
+    default:
+      break;
+    }
+
+  h1 ^= length;
+  h2 ^= length;
+
+  h1 += h2;
+  h2 += h1;
+
+  h1 = fmix64 (h1);
+  h2 = fmix64 (h2);
+
+  h1 += h2;
+  h2 += h1;
 
-  tv.tv_sec = timestamp;
-  tv.tv_usec = 0;
-  return g_time_val_to_iso8601 (&tv);
+  hash[0] = h1;
+  hash[1] = h2;
 }
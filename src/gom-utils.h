@@ -28,9 +28,25 @@
 
 G_BEGIN_DECLS
 
+gboolean gom_filename_lookup_type (const gchar *filename_with_extension,
+                                   const gchar **rdf_type,
+                                   const gchar **mime_type);
+
 const gchar *gom_filename_to_rdf_type (const gchar *filename_with_extension);
 
-gchar *gom_iso8601_from_timestamp (gint64 timestamp);
+/* enough for "YYYY-MM-DDTHH:MM:SSZ" with any 64-bit year */
+#define GOM_ISO8601_SIZE 32
+
+const gchar *gom_iso8601_format (gint64 timestamp,
+                                 gchar buffer[GOM_ISO8601_SIZE]);
+
+gboolean gom_iso8601_parse (const gchar *iso8601,
+                            gint64 *timestamp);
+
+void gom_murmur_hash3_128 (gconstpointer key,
+                           gsize length,
+                           guint32 seed,
+                           guint64 hash[2]);
 
 G_END_DECLS
 
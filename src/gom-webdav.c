@@ -0,0 +1,605 @@
+/*
+ * GNOME Online Miners - crawls through your online content
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#include <libsoup/soup.h>
+
+#include "gom-webdav.h"
+
+struct _GomWebdav {
+  SoupSession *session;
+  SoupURI *uri;
+  gchar *authorization;
+  gchar *base_path;
+  gchar *password;
+  gchar *username;
+};
+
+#define READ_BUFFER_SIZE 8192
+
+static const gchar propfind_body[] =
+  "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+  "<d:propfind xmlns:d=\"DAV:\">"
+  "<d:prop>"
+  "<d:displayname/>"
+  "<d:getcontenttype/>"
+  "<d:getetag/>"
+  "<d:getlastmodified/>"
+  "<d:resourcetype/>"
+  "</d:prop>"
+  "</d:propfind>";
+
+typedef struct {
+  GCancellable *cancellable;
+  GInputStream *stream;
+  GMarkupParseContext *parser;
+  GSimpleAsyncResult *result;
+  GString *text;
+  GomWebdav *webdav;
+  GomWebdavEntryFunc entry_func;
+  SoupMessage *msg;
+  gboolean collect;
+  gboolean infinite_depth;
+  gboolean is_collection;
+  gchar *content_type;
+  gchar *display_name;
+  gchar *etag;
+  gchar *href;
+  gchar *last_modified;
+  gchar *path;
+  gchar buffer[READ_BUFFER_SIZE];
+  gpointer entry_data;
+} PropfindOp;
+
+static const gchar *
+element_local_name (const gchar *element_name)
+{
+  const gchar *colon;
+
+  /* GMarkup knows nothing about namespaces, and servers do not agree
+   * on the prefix to use for DAV:
+   */
+  colon = strrchr (element_name, ':');
+  return (colon != NULL) ? colon + 1 : element_name;
+}
+
+static gchar *
+unescape_path (const gchar *path)
+{
+  gchar *retval;
+  gsize len;
+
+  retval = g_uri_unescape_string (path, NULL);
+  if (retval == NULL)
+    return NULL;
+
+  /* collections may or may not come with a trailing slash */
+  len = strlen (retval);
+  while (len > 0 && retval[len - 1] == '/')
+    retval[--len] = '\0';
+
+  return retval;
+}
+
+static void
+propfind_op_clear_entry (PropfindOp *op)
+{
+  g_clear_pointer (&op->content_type, g_free);
+  g_clear_pointer (&op->display_name, g_free);
+  g_clear_pointer (&op->etag, g_free);
+  g_clear_pointer (&op->href, g_free);
+  g_clear_pointer (&op->last_modified, g_free);
+  op->collect = FALSE;
+  op->is_collection = FALSE;
+}
+
+static void
+propfind_op_free (PropfindOp *op)
+{
+  propfind_op_clear_entry (op);
+
+  if (op->stream != NULL)
+    {
+      g_input_stream_close_async (op->stream, G_PRIORITY_DEFAULT, NULL, NULL, NULL);
+      g_object_unref (op->stream);
+    }
+
+  g_clear_object (&op->cancellable);
+  g_clear_object (&op->msg);
+  g_markup_parse_context_free (op->parser);
+  g_object_unref (op->result);
+  g_string_free (op->text, TRUE);
+  g_free (op->path);
+
+  g_slice_free (PropfindOp, op);
+}
+
+static void
+propfind_op_complete (PropfindOp *op,
+                      GError *error)
+{
+  if (error != NULL)
+    g_simple_async_result_take_error (op->result, error);
+
+  g_simple_async_result_complete (op->result);
+  propfind_op_free (op);
+}
+
+static void
+propfind_op_emit_entry (PropfindOp *op)
+{
+  GFileInfo *info;
+  SoupURI *uri;
+  const gchar *name;
+  const gchar *relative;
+  gchar *path = NULL;
+
+  if (op->href == NULL)
+    goto out;
+
+  /* an href is either an absolute URI or an absolute path */
+  uri = soup_uri_new_with_base (op->webdav->uri, op->href);
+  if (uri == NULL)
+    goto out;
+
+  path = unescape_path (soup_uri_get_path (uri));
+  soup_uri_free (uri);
+
+  if (path == NULL || !g_str_has_prefix (path, op->webdav->base_path))
+    goto out;
+
+  relative = path + strlen (op->webdav->base_path);
+  if (relative[0] == '/')
+    relative++;
+  else if (relative[0] != '\0')
+    goto out;
+
+  /* the requested collection always comes first */
+  if (g_strcmp0 (relative, op->path) == 0)
+    goto out;
+
+  name = strrchr (relative, '/');
+  name = (name != NULL) ? name + 1 : relative;
+
+  info = g_file_info_new ();
+  g_file_info_set_name (info, name);
+
+  if (op->display_name != NULL && op->display_name[0] != '\0')
+    g_file_info_set_display_name (info, op->display_name);
+  else
+    g_file_info_set_display_name (info, name);
+
+  if (op->is_collection)
+    {
+      g_file_info_set_file_type (info, G_FILE_TYPE_DIRECTORY);
+      g_file_info_set_content_type (info, "inode/directory");
+    }
+  else
+    {
+      gchar *content_type;
+
+      g_file_info_set_file_type (info, G_FILE_TYPE_REGULAR);
+
+      if (op->content_type != NULL && op->content_type[0] != '\0')
+        {
+          content_type = g_strdup (op->content_type);
+          content_type[strcspn (content_type, ";")] = '\0';
+          g_strstrip (content_type);
+        }
+      else
+        content_type = g_content_type_guess (name, NULL, 0, NULL);
+
+      g_file_info_set_content_type (info, content_type);
+      g_free (content_type);
+    }
+
+  if (op->last_modified != NULL)
+    {
+      SoupDate *date;
+
+      date = soup_date_new_from_string (op->last_modified);
+      if (date != NULL)
+        {
+          GTimeVal tv = { 0, 0 };
+
+          tv.tv_sec = soup_date_to_time_t (date);
+          g_file_info_set_modification_time (info, &tv);
+          soup_date_free (date);
+        }
+    }
+
+  if (op->etag != NULL)
+    g_file_info_set_attribute_string (info, G_FILE_ATTRIBUTE_ETAG_VALUE, op->etag);
+
+  op->entry_func (relative, info, op->entry_data);
+  g_object_unref (info);
+
+ out:
+  g_free (path);
+  propfind_op_clear_entry (op);
+}
+
+static void
+propfind_op_take_text (PropfindOp *op,
+                       gchar **field)
+{
+  g_free (*field);
+  *field = g_strstrip (g_strdup (op->text->str));
+  op->collect = FALSE;
+}
+
+static void
+propfind_start_element (GMarkupParseContext *context,
+                        const gchar *element_name,
+                        const gchar **attribute_names,
+                        const gchar **attribute_values,
+                        gpointer user_data,
+                        GError **error)
+{
+  PropfindOp *op = user_data;
+  const gchar *name;
+
+  name = element_local_name (element_name);
+
+  if (g_strcmp0 (name, "response") == 0)
+    propfind_op_clear_entry (op);
+  else if (g_strcmp0 (name, "collection") == 0)
+    op->is_collection = TRUE;
+  else if (g_strcmp0 (name, "href") == 0
+           || g_strcmp0 (name, "displayname") == 0
+           || g_strcmp0 (name, "getcontenttype") == 0
+           || g_strcmp0 (name, "getetag") == 0
+           || g_strcmp0 (name, "getlastmodified") == 0)
+    {
+      g_string_truncate (op->text, 0);
+      op->collect = TRUE;
+    }
+}
+
+static void
+propfind_end_element (GMarkupParseContext *context,
+                      const gchar *element_name,
+                      gpointer user_data,
+                      GError **error)
+{
+  PropfindOp *op = user_data;
+  const gchar *name;
+
+  name = element_local_name (element_name);
+
+  if (g_strcmp0 (name, "response") == 0)
+    propfind_op_emit_entry (op);
+  else if (!op->collect)
+    return;
+  else if (g_strcmp0 (name, "href") == 0)
+    propfind_op_take_text (op, &op->href);
+  else if (g_strcmp0 (name, "displayname") == 0)
+    propfind_op_take_text (op, &op->display_name);
+  else if (g_strcmp0 (name, "getcontenttype") == 0)
+    propfind_op_take_text (op, &op->content_type);
+  else if (g_strcmp0 (name, "getetag") == 0)
+    propfind_op_take_text (op, &op->etag);
+  else if (g_strcmp0 (name, "getlastmodified") == 0)
+    propfind_op_take_text (op, &op->last_modified);
+}
+
+static void
+propfind_text (GMarkupParseContext *context,
+               const gchar *text,
+               gsize text_len,
+               gpointer user_data,
+               GError **error)
+{
+  PropfindOp *op = user_data;
+
+  if (op->collect)
+    g_string_append_len (op->text, text, text_len);
+}
+
+static const GMarkupParser propfind_parser = {
+  propfind_start_element,
+  propfind_end_element,
+  propfind_text,
+  NULL,
+  NULL
+};
+
+static void propfind_read_cb (GObject *source_object,
+                              GAsyncResult *res,
+                              gpointer user_data);
+
+static void
+propfind_op_read (PropfindOp *op)
+{
+  g_input_stream_read_async (op->stream,
+                             op->buffer,
+                             sizeof (op->buffer),
+                             G_PRIORITY_DEFAULT,
+                             op->cancellable,
+                             propfind_read_cb,
+                             op);
+}
+
+static void
+propfind_read_cb (GObject *source_object,
+                  GAsyncResult *res,
+                  gpointer user_data)
+{
+  PropfindOp *op = user_data;
+  GError *error = NULL;
+  gssize n_read;
+
+  n_read = g_input_stream_read_finish (op->stream, res, &error);
+  if (n_read < 0)
+    goto out;
+
+  /* the multistatus is parsed as it arrives, so entries reach the
+   * caller without the whole response being held in memory
+   */
+  if (n_read == 0)
+    {
+      g_markup_parse_context_end_parse (op->parser, &error);
+      goto out;
+    }
+
+  if (!g_markup_parse_context_parse (op->parser, op->buffer, n_read, &error))
+    goto out;
+
+  propfind_op_read (op);
+  return;
+
+ out:
+  propfind_op_complete (op, error);
+}
+
+static GError *
+propfind_status_error (PropfindOp *op)
+{
+  gint code;
+
+  switch (op->msg->status_code)
+    {
+    case SOUP_STATUS_BAD_REQUEST:
+    case SOUP_STATUS_FORBIDDEN:
+      /* propfind-finite-depth, see RFC 4918 section 9.1 */
+      if (op->infinite_depth)
+        code = G_IO_ERROR_NOT_SUPPORTED;
+      else if (op->msg->status_code == SOUP_STATUS_FORBIDDEN)
+        code = G_IO_ERROR_PERMISSION_DENIED;
+      else
+        code = G_IO_ERROR_FAILED;
+      break;
+
+    case SOUP_STATUS_UNAUTHORIZED:
+      code = G_IO_ERROR_PERMISSION_DENIED;
+      break;
+
+    case SOUP_STATUS_NOT_FOUND:
+      code = G_IO_ERROR_NOT_FOUND;
+      break;
+
+    default:
+      code = G_IO_ERROR_FAILED;
+      break;
+    }
+
+  return g_error_new (G_IO_ERROR, code, "PROPFIND failed: %u %s",
+                      op->msg->status_code, op->msg->reason_phrase);
+}
+
+static void
+propfind_send_cb (GObject *source_object,
+                  GAsyncResult *res,
+                  gpointer user_data)
+{
+  PropfindOp *op = user_data;
+  GError *error = NULL;
+
+  op->stream = soup_session_send_finish (SOUP_SESSION (source_object), res, &error);
+  if (error != NULL)
+    goto out;
+
+  if (op->msg->status_code != SOUP_STATUS_MULTI_STATUS)
+    {
+      error = propfind_status_error (op);
+      goto out;
+    }
+
+  propfind_op_read (op);
+  return;
+
+ out:
+  propfind_op_complete (op, error);
+}
+
+static void
+session_authenticate_cb (SoupSession *session,
+                         SoupMessage *msg,
+                         SoupAuth *auth,
+                         gboolean retrying,
+                         gpointer user_data)
+{
+  GomWebdav *self = user_data;
+
+  /* the same credentials would only be refused again */
+  if (retrying || soup_auth_is_for_proxy (auth))
+    return;
+
+  soup_auth_authenticate (auth, self->username, self->password);
+}
+
+GomWebdav *
+gom_webdav_new (const gchar *uri,
+                const gchar *username,
+                const gchar *password,
+                guint max_connections,
+                GError **error)
+{
+  GomWebdav *self = NULL;
+  SoupURI *soup_uri;
+  gchar *http_uri;
+
+  /* GVfs names the schemes after the protocol, libsoup after the
+   * transport underneath
+   */
+  if (g_str_has_prefix (uri, "davs://"))
+    http_uri = g_strconcat ("https://", uri + strlen ("davs://"), NULL);
+  else if (g_str_has_prefix (uri, "dav://"))
+    http_uri = g_strconcat ("http://", uri + strlen ("dav://"), NULL);
+  else
+    http_uri = g_strdup (uri);
+
+  soup_uri = soup_uri_new (http_uri);
+  if (soup_uri == NULL || !SOUP_URI_VALID_FOR_HTTP (soup_uri))
+    {
+      g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Invalid WebDAV URI %s", uri);
+      if (soup_uri != NULL)
+        soup_uri_free (soup_uri);
+      goto out;
+    }
+
+  /* the credentials are handled by the session instead */
+  soup_uri_set_user (soup_uri, NULL);
+  soup_uri_set_password (soup_uri, NULL);
+
+  self = g_slice_new0 (GomWebdav);
+  self->uri = soup_uri;
+  self->base_path = unescape_path (soup_uri_get_path (soup_uri));
+  if (self->base_path == NULL)
+    self->base_path = g_strdup ("");
+
+  /* enough keep-alive connections for every concurrent PROPFIND to
+   * have its own
+   */
+  self->session = soup_session_new_with_options (SOUP_SESSION_MAX_CONNS_PER_HOST, MAX (max_connections, 1),
+                                                 NULL);
+
+  if (username != NULL)
+    {
+      self->username = g_strdup (username);
+      self->password = g_strdup (password);
+
+      g_signal_connect (self->session, "authenticate",
+                        G_CALLBACK (session_authenticate_cb), self);
+
+      /* sending the credentials upfront saves a round trip for every
+       * connection, but only an encrypted one can be trusted with them
+       */
+      if (soup_uri_get_scheme (soup_uri) == SOUP_URI_SCHEME_HTTPS)
+        {
+          gchar *credentials;
+          gchar *encoded;
+
+          credentials = g_strconcat (username, ":", password, NULL);
+          encoded = g_base64_encode ((const guchar *) credentials, strlen (credentials));
+          self->authorization = g_strconcat ("Basic ", encoded, NULL);
+          g_free (encoded);
+          g_free (credentials);
+        }
+    }
+
+ out:
+  g_free (http_uri);
+  return self;
+}
+
+void
+gom_webdav_free (GomWebdav *self)
+{
+  soup_session_abort (self->session);
+  g_object_unref (self->session);
+  soup_uri_free (self->uri);
+  g_free (self->authorization);
+  g_free (self->base_path);
+  g_free (self->password);
+  g_free (self->username);
+
+  g_slice_free (GomWebdav, self);
+}
+
+void
+gom_webdav_propfind_async (GomWebdav *self,
+                           const gchar *path,
+                           gboolean infinite_depth,
+                           GCancellable *cancellable,
+                           GomWebdavEntryFunc entry_func,
+                           gpointer entry_data,
+                           GAsyncReadyCallback callback,
+                           gpointer user_data)
+{
+  PropfindOp *op;
+  SoupURI *uri;
+  gchar *escaped;
+  gchar *request_path;
+
+  op = g_slice_new0 (PropfindOp);
+  op->webdav = self;
+  op->cancellable = (cancellable != NULL) ? g_object_ref (cancellable) : NULL;
+  op->entry_func = entry_func;
+  op->entry_data = entry_data;
+  op->infinite_depth = infinite_depth;
+  op->path = g_strdup ((path != NULL) ? path : "");
+  op->parser = g_markup_parse_context_new (&propfind_parser, 0, op, NULL);
+  op->result = g_simple_async_result_new (NULL, callback, user_data, gom_webdav_propfind_async);
+  op->text = g_string_new (NULL);
+
+  /* the trailing slash spares a redirect for collections */
+  request_path = g_strconcat (self->base_path, "/", op->path, (op->path[0] != '\0') ? "/" : "", NULL);
+  escaped = g_uri_escape_string (request_path, "/", FALSE);
+
+  uri = soup_uri_copy (self->uri);
+  soup_uri_set_path (uri, escaped);
+
+  op->msg = soup_message_new_from_uri ("PROPFIND", uri);
+  soup_message_headers_replace (op->msg->request_headers, "Depth", infinite_depth ? "infinity" : "1");
+  if (self->authorization != NULL)
+    soup_message_headers_replace (op->msg->request_headers, "Authorization", self->authorization);
+
+  soup_message_set_request (op->msg,
+                            "application/xml; charset=utf-8",
+                            SOUP_MEMORY_STATIC,
+                            propfind_body,
+                            sizeof (propfind_body) - 1);
+
+  soup_session_send_async (self->session, op->msg, op->cancellable, propfind_send_cb, op);
+
+  soup_uri_free (uri);
+  g_free (escaped);
+  g_free (request_path);
+}
+
+gboolean
+gom_webdav_propfind_finish (GomWebdav *self,
+                            GAsyncResult *res,
+                            GError **error)
+{
+  GSimpleAsyncResult *simple_res = G_SIMPLE_ASYNC_RESULT (res);
+
+  g_assert (g_simple_async_result_is_valid (res, NULL, gom_webdav_propfind_async));
+
+  if (g_simple_async_result_propagate_error (simple_res, error))
+    return FALSE;
+
+  return TRUE;
+}
@@ -0,0 +1,62 @@
+/*
+ * GNOME Online Miners - crawls through your online content
+ * Copyright (c) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301, USA.
+ *
+ */
+
+#ifndef __GOM_WEBDAV_H__
+#define __GOM_WEBDAV_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GomWebdav GomWebdav;
+
+/* path is unescaped and relative to the URI the GomWebdav was created
+ * for; info carries the name, display name, type, content type, mtime
+ * and ETag of the entry
+ */
+typedef void (*GomWebdavEntryFunc) (const gchar *path,
+                                    GFileInfo *info,
+                                    gpointer user_data);
+
+GomWebdav *gom_webdav_new (const gchar *uri,
+                           const gchar *username,
+                           const gchar *password,
+                           guint max_connections,
+                           GError **error);
+
+void gom_webdav_free (GomWebdav *self);
+
+void gom_webdav_propfind_async (GomWebdav *self,
+                                const gchar *path,
+                                gboolean infinite_depth,
+                                GCancellable *cancellable,
+                                GomWebdavEntryFunc entry_func,
+                                gpointer entry_data,
+                                GAsyncReadyCallback callback,
+                                gpointer user_data);
+
+gboolean gom_webdav_propfind_finish (GomWebdav *self,
+                                     GAsyncResult *res,
+                                     GError **error);
+
+G_END_DECLS
+
+#endif /* __GOM_WEBDAV_H__ */
@@ -23,9 +23,14 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include <goa/goa.h>
+#include <json-glib/json-glib.h>
+#include <libsoup/soup.h>
 #include <zpj/zpj.h>
 
+#include "gom-crawler.h"
 #include "gom-zpj-miner.h"
 #include "gom-utils.h"
 
@@ -33,34 +38,97 @@
 
 G_DEFINE_TYPE (GomZpjMiner, gom_zpj_miner, GOM_TYPE_MINER)
 
+struct _GomZpjMinerPrivate {
+  gboolean delta;
+  guint max_depth;
+  guint max_listings;
+};
+
+/* number of folders being listed at the same time; can be overridden
+ * with ZPJ_MINER_MAX_LISTINGS
+ */
+#define DEFAULT_MAX_LISTINGS 4
+
+/* folders deeper than this are not listed; can be overridden with
+ * ZPJ_MINER_MAX_DEPTH
+ */
+#define DEFAULT_MAX_DEPTH G_MAXUINT
+
+/* with ZPJ_MINER_DELTA set, refreshes after the first one only fetch
+ * what changed since the token stored in the account state
+ */
+#define DELTA_URI "https://api.onedrive.com/v1.0/drive/root/view.delta"
+#define STATE_DELTA_TOKEN "delta-token"
+
+/* the session for the delta requests lives as long as the service, so
+ * that its connections are reused across refreshes
+ */
+#define DELTA_SESSION_KEY "gom-delta-session"
+
+typedef struct {
+  GomAccountMinerJob *job;
+  GomCrawler *crawler;
+  GString *unwalked; /* identifiers of the folders beyond the depth limit */
+  gboolean incomplete;
+} TraverseData;
+
+typedef struct {
+  TraverseData *data;
+  gchar *folder_id;
+  guint depth;
+} ListingOp;
+
+/* what is needed to store an entry, whether it came from zapojit or
+ * from a delta
+ */
+typedef struct {
+  const gchar *id;
+  const gchar *parent_id;
+  const gchar *name;
+  const gchar *description;
+  const gchar *from_name;
+  gint64 created_time;
+  gint64 updated_time;
+  gboolean is_folder;
+} EntryFields;
+
+static void
+entry_fields_init_from_entry (EntryFields *fields,
+                              ZpjSkydriveEntry *entry)
+{
+  fields->id = zpj_skydrive_entry_get_id (entry);
+  fields->parent_id = zpj_skydrive_entry_get_parent_id (entry);
+  fields->name = zpj_skydrive_entry_get_name (entry);
+  fields->description = zpj_skydrive_entry_get_description (entry);
+  fields->from_name = zpj_skydrive_entry_get_from_name (entry);
+  fields->created_time = g_date_time_to_unix (zpj_skydrive_entry_get_created_time (entry));
+  fields->updated_time = g_date_time_to_unix (zpj_skydrive_entry_get_updated_time (entry));
+  fields->is_folder = ZPJ_IS_SKYDRIVE_FOLDER (entry);
+}
+
 static gboolean
 account_miner_job_process_entry (GomAccountMinerJob *job,
-                                 ZpjSkydriveEntry *entry,
+                                 const EntryFields *fields,
                                  GError **error)
 {
-  GDateTime *created_time, *updated_time;
   gchar *contact_resource;
   gchar *resource = NULL;
-  gchar *date, *identifier;
-  const gchar *class = NULL, *id, *name;
+  gchar date[GOM_ISO8601_SIZE];
+  gchar *identifier;
+  const gchar *class = NULL, *mime_type = NULL;
   gboolean resource_exists, mtime_changed;
-  gint64 new_mtime;
-
-  id = zpj_skydrive_entry_get_id (entry);
 
   identifier = g_strdup_printf ("%swindows-live:skydrive:%s",
-                                ZPJ_IS_SKYDRIVE_FOLDER (entry) ? "gd:collection:" : "",
-                                id);
+                                fields->is_folder ? "gd:collection:" : "",
+                                fields->id);
 
   /* remove from the list of the previous resources */
-  g_hash_table_remove (job->previous_resources, identifier);
-
-  name = zpj_skydrive_entry_get_name (entry);
+  gom_account_miner_job_mark_processed (job, identifier);
 
-  if (ZPJ_IS_SKYDRIVE_FILE (entry))
-    class = gom_filename_to_rdf_type (name);
-  else if (ZPJ_IS_SKYDRIVE_FOLDER (entry))
+  if (fields->is_folder)
     class = "nfo:DataContainer";
+  else
+    gom_filename_lookup_type (fields->name, &class, &mime_type);
 
   resource = gom_tracker_sparql_connection_ensure_resource
     (job->connection,
@@ -79,9 +147,7 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
   if (*error != NULL)
     goto out;
 
-  updated_time = zpj_skydrive_entry_get_updated_time (entry);
-  new_mtime = g_date_time_to_unix (updated_time);
-  mtime_changed = gom_tracker_update_mtime (job->connection, new_mtime,
+  mtime_changed = gom_tracker_update_mtime (job->connection, fields->updated_time,
                                             resource_exists, identifier, resource,
                                             job->cancellable, error);
 
@@ -104,14 +170,12 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
   if (*error != NULL)
     goto out;
 
-  if (ZPJ_IS_SKYDRIVE_FILE (entry))
+  if (!fields->is_folder)
     {
       gchar *parent_resource_urn, *parent_identifier;
       gchar *mime;
-      const gchar *parent_id;
 
-      parent_id = zpj_skydrive_entry_get_parent_id (entry);
-      parent_identifier = g_strconcat ("gd:collection:windows-live:skydrive:", parent_id, NULL);
+      parent_identifier = g_strconcat ("gd:collection:windows-live:skydrive:", fields->parent_id, NULL);
       parent_resource_urn = gom_tracker_sparql_connection_ensure_resource
         (job->connection, job->cancellable, error,
          NULL,
@@ -132,7 +196,12 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
       if (*error != NULL)
         goto out;
 
-      mime = g_content_type_guess (name, NULL, 0, NULL);
+      /* only sniff the name for what the table does not know */
+      if (mime_type != NULL)
+        mime = g_strdup (mime_type);
+      else
+        mime = g_content_type_guess (fields->name, NULL, 0, NULL);
+
       if (mime != NULL)
         {
           gom_tracker_sparql_connection_insert_or_replace_triple
@@ -151,7 +220,7 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
     (job->connection,
      job->cancellable, error,
      job->datasource_urn, resource,
-     "nie:description", zpj_skydrive_entry_get_description (entry));
+     "nie:description", fields->description);
 
   if (*error != NULL)
     goto out;
@@ -160,7 +229,7 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
     (job->connection,
      job->cancellable, error,
      job->datasource_urn, resource,
-     "nfo:fileName", name);
+     "nfo:fileName", fields->name);
 
   if (*error != NULL)
     goto out;
@@ -168,7 +237,7 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
   contact_resource = gom_tracker_utils_ensure_contact_resource
     (job->connection,
      job->cancellable, error,
-     job->datasource_urn, zpj_skydrive_entry_get_from_name (entry));
+     job->datasource_urn, fields->from_name);
 
   if (*error != NULL)
     goto out;
@@ -183,14 +252,12 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
   if (*error != NULL)
     goto out;
 
-  created_time = zpj_skydrive_entry_get_created_time (entry);
-  date = gom_iso8601_from_timestamp (g_date_time_to_unix (created_time));
+  gom_iso8601_format (fields->created_time, date);
   gom_tracker_sparql_connection_insert_or_replace_triple
     (job->connection,
      job->cancellable, error,
      job->datasource_urn, resource,
      "nie:contentCreated", date);
-  g_free (date);
 
   if (*error != NULL)
     goto out;
@@ -206,56 +273,721 @@ account_miner_job_process_entry (GomAccountMinerJob *job,
 }
 
 static void
-account_miner_job_traverse_folder (GomAccountMinerJob *job,
-                                   const gchar *folder_id,
-                                   GError **error)
+list_folder_id_cb (GObject *source_object,
+                   GAsyncResult *res,
+                   gpointer user_data)
 {
+  ListingOp *op = user_data;
+  TraverseData *data = op->data;
+  GomAccountMinerJob *job = data->job;
+  GError *error = NULL;
   GList *entries, *l;
 
-  entries = zpj_skydrive_list_folder_id (ZPJ_SKYDRIVE (job->service),
-                                         folder_id,
-                                         job->cancellable,
-                                         error);
-  if (*error != NULL)
-    goto out;
+  entries = zpj_skydrive_list_folder_id_finish (ZPJ_SKYDRIVE (source_object), res, &error);
+  if (error != NULL)
+    {
+      /* a folder that cannot be listed only fails the whole
+       * traversal if it is the root
+       */
+      if (op->depth == 0)
+        gom_crawler_abort (data->crawler, error);
+      else if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_warning ("Unable to list folder %s: %s", op->folder_id, error->message);
+          data->incomplete = TRUE;
+        }
+
+      g_error_free (error);
+      goto out;
+    }
 
+  /* the listings complete on this thread, one at a time, so the
+   * entries are written out while other folders are still being
+   * fetched
+   */
   for (l = entries; l != NULL; l = l->next)
     {
       ZpjSkydriveEntry *entry = (ZpjSkydriveEntry *) l->data;
-      const gchar *id;
+      EntryFields fields;
+
+      if (ZPJ_IS_SKYDRIVE_PHOTO (entry))
+        continue;
 
-      id = zpj_skydrive_entry_get_id (entry);
+      entry_fields_init_from_entry (&fields, entry);
 
-      if (ZPJ_IS_SKYDRIVE_FOLDER (entry))
+      /* what is stored below a folder that is not walked is kept */
+      if (fields.is_folder
+          && !gom_crawler_add (data->crawler, g_strdup (fields.id), op->depth + 1))
         {
-          account_miner_job_traverse_folder (job, id, error);
-          if (*error != NULL)
-            goto out;
+          /* the ids end up inside a SPARQL string */
+          if (strpbrk (fields.id, "\"\\") != NULL)
+            data->incomplete = TRUE;
+          else
+            {
+              if (data->unwalked->len > 0)
+                g_string_append_c (data->unwalked, ',');
+
+              g_string_append_printf (data->unwalked,
+                                      "\"gd:collection:windows-live:skydrive:%s\"",
+                                      fields.id);
+            }
         }
-      else if (ZPJ_IS_SKYDRIVE_PHOTO (entry))
-        continue;
 
-      account_miner_job_process_entry (job, entry, error);
+      account_miner_job_process_entry (job, &fields, &error);
+
+      if (error != NULL)
+        {
+          g_warning ("Unable to process entry %p: %s", l->data, error->message);
+          g_clear_error (&error);
+        }
+    }
+
+ out:
+  g_list_free_full (entries, g_object_unref);
+  g_free (op->folder_id);
+  g_slice_free (ListingOp, op);
+
+  gom_crawler_done (data->crawler);
+}
+
+static void
+account_miner_job_list_folder (GomCrawler *crawler,
+                               gpointer node,
+                               guint depth,
+                               gpointer user_data)
+{
+  TraverseData *data = user_data;
+  GomAccountMinerJob *job = data->job;
+  ListingOp *op;
+
+  op = g_slice_new0 (ListingOp);
+  op->data = data;
+  op->folder_id = node;
+  op->depth = depth;
+
+  zpj_skydrive_list_folder_id_async (ZPJ_SKYDRIVE (job->service),
+                                     op->folder_id,
+                                     job->cancellable,
+                                     list_folder_id_cb,
+                                     op);
+}
+
+static const gchar *
+json_object_lookup_string (JsonObject *object,
+                           const gchar *member_name)
+{
+  JsonNode *node;
+
+  if (object == NULL)
+    return NULL;
+
+  node = json_object_get_member (object, member_name);
+  if (node == NULL || JSON_NODE_TYPE (node) != JSON_NODE_VALUE)
+    return NULL;
+
+  return json_node_get_string (node);
+}
+
+static JsonObject *
+json_object_lookup_object (JsonObject *object,
+                           const gchar *member_name)
+{
+  JsonNode *node;
+
+  if (object == NULL)
+    return NULL;
+
+  node = json_object_get_member (object, member_name);
+  if (node == NULL || JSON_NODE_TYPE (node) != JSON_NODE_OBJECT)
+    return NULL;
+
+  return json_node_get_object (node);
+}
+
+/* the OneDrive API leaves out the "<type>.<cid>." prefix that Live
+ * Connect, and so zapojit, puts in front of every id; the root folder
+ * is just "folder.<cid>" there
+ */
+static gchar *
+delta_item_to_live_id (const gchar *type,
+                       const gchar *id,
+                       gboolean is_root)
+{
+  const gchar *bang;
+  gchar *cid;
+  gchar *retval;
+
+  bang = strchr (id, '!');
+  if (bang == NULL)
+    return NULL;
+
+  cid = g_ascii_strdown (id, bang - id);
+
+  if (is_root)
+    retval = g_strconcat ("folder.", cid, NULL);
+  else
+    retval = g_strconcat (type, ".", cid, ".", id, NULL);
+
+  g_free (cid);
+  return retval;
+}
+
+static void
+deletions_append (GString *deletions,
+                  const gchar *prefix,
+                  const gchar *live_id)
+{
+  if (deletions->len > 0)
+    g_string_append_c (deletions, ',');
+
+  g_string_append_printf (deletions, "\"%swindows-live:skydrive:%s\"", prefix, live_id);
+}
+
+static void
+account_miner_job_process_delta_item (GomAccountMinerJob *job,
+                                      JsonObject *item,
+                                      GString *deletions,
+                                      GError **error)
+{
+  EntryFields fields;
+  JsonObject *parent;
+  JsonObject *user;
+  gchar *live_id = NULL;
+  gchar *parent_live_id = NULL;
+  const gchar *created;
+  const gchar *id;
+  const gchar *parent_id;
+  const gchar *parent_path;
+  const gchar *type;
+  const gchar *updated;
+
+  id = json_object_lookup_string (item, "id");
+
+  /* the root is not indexed by a full crawl either, and the ids end
+   * up inside a SPARQL string
+   */
+  if (id == NULL
+      || json_object_has_member (item, "root")
+      || strpbrk (id, "\"\\") != NULL)
+    goto out;
+
+  if (json_object_has_member (item, "deleted"))
+    {
+      /* a deleted item does not always say what it was */
+      live_id = delta_item_to_live_id ("folder", id, FALSE);
+      if (live_id != NULL)
+        deletions_append (deletions, "gd:collection:", live_id);
+      g_free (live_id);
+
+      live_id = delta_item_to_live_id ("file", id, FALSE);
+      if (live_id != NULL)
+        deletions_append (deletions, "", live_id);
+      g_free (live_id);
+
+      live_id = delta_item_to_live_id ("video", id, FALSE);
+      if (live_id != NULL)
+        deletions_append (deletions, "", live_id);
+
+      goto out;
+    }
+
+  /* photos are skipped by the full crawl too */
+  if (json_object_has_member (item, "image"))
+    goto out;
+
+  memset (&fields, 0, sizeof (fields));
+  fields.is_folder = json_object_has_member (item, "folder");
+
+  if (fields.is_folder)
+    type = "folder";
+  else if (json_object_has_member (item, "video"))
+    type = "video";
+  else
+    type = "file";
+
+  live_id = delta_item_to_live_id (type, id, FALSE);
+  if (live_id == NULL)
+    goto out;
+
+  parent = json_object_lookup_object (item, "parentReference");
+  parent_path = json_object_lookup_string (parent, "path");
+  parent_id = json_object_lookup_string (parent, "id");
+  if (parent_id != NULL)
+    parent_live_id = delta_item_to_live_id ("folder",
+                                            parent_id,
+                                            g_strcmp0 (parent_path, "/drive/root:") == 0);
+
+  user = json_object_lookup_object (json_object_lookup_object (item, "createdBy"), "user");
+
+  fields.id = live_id;
+  fields.parent_id = parent_live_id;
+  fields.name = json_object_lookup_string (item, "name");
+  fields.description = json_object_lookup_string (item, "description");
+  fields.from_name = json_object_lookup_string (user, "displayName");
+
+  created = json_object_lookup_string (item, "createdDateTime");
+  updated = json_object_lookup_string (item, "lastModifiedDateTime");
+
+  if (fields.name == NULL
+      || (!fields.is_folder && fields.parent_id == NULL)
+      || created == NULL || !gom_iso8601_parse (created, &fields.created_time)
+      || updated == NULL || !gom_iso8601_parse (updated, &fields.updated_time))
+    {
+      g_warning ("Skipping incomplete delta item %s", live_id);
+      goto out;
+    }
+
+  account_miner_job_process_entry (job, &fields, error);
+
+ out:
+  g_free (live_id);
+  g_free (parent_live_id);
+}
+
+static void
+account_miner_job_query_urns (GomAccountMinerJob *job,
+                              const gchar *select,
+                              GPtrArray *urns,
+                              GHashTable *seen,
+                              GError **error)
+{
+  TrackerSparqlCursor *cursor;
+
+  cursor = tracker_sparql_connection_query (job->connection,
+                                            select,
+                                            job->cancellable,
+                                            error);
+  if (cursor == NULL)
+    return;
+
+  while (tracker_sparql_cursor_next (cursor, job->cancellable, error))
+    {
+      gchar *urn;
+
+      urn = g_strdup (tracker_sparql_cursor_get_string (cursor, 0, NULL));
+      if (urn == NULL || g_hash_table_contains (seen, urn))
+        {
+          g_free (urn);
+          continue;
+        }
+
+      /* owned by urns */
+      g_hash_table_add (seen, urn);
+      g_ptr_array_add (urns, urn);
+    }
+
+  g_object_unref (cursor);
+}
+
+static gchar *
+urns_to_list (GPtrArray *urns,
+              guint start,
+              guint end)
+{
+  GString *list;
+  guint idx;
+
+  list = g_string_new (NULL);
+  for (idx = start; idx < end; idx++)
+    {
+      if (list->len > 0)
+        g_string_append_c (list, ',');
+
+      g_string_append_printf (list, "<%s>", (const gchar *) g_ptr_array_index (urns, idx));
+    }
+
+  return g_string_free (list, FALSE);
+}
+
+/* returns the URNs of the resources with the given identifiers, a
+ * comma-separated list of quoted strings, and of everything stored
+ * below them; with moved_out, what is also part of a resource outside
+ * of the subtrees is left out
+ */
+static GPtrArray *
+account_miner_job_collect_subtrees (GomAccountMinerJob *job,
+                                    const gchar *identifiers,
+                                    gboolean moved_out,
+                                    GError **error)
+{
+  GHashTable *seen;
+  GPtrArray *urns;
+  gchar *select;
+  guint end;
+  guint start = 0;
+
+  urns = g_ptr_array_new_with_free_func (g_free);
+  seen = g_hash_table_new (g_str_hash, g_str_equal);
+
+  select = g_strdup_printf ("SELECT ?urn "
+                            "WHERE { ?urn nie:dataSource <%s> ; nao:identifier ?id . "
+                            "FILTER (?id IN (%s)) }",
+                            job->datasource_urn, identifiers);
+  account_miner_job_query_urns (job, select, urns, seen, error);
+  g_free (select);
+
+  while (*error == NULL && start < urns->len)
+    {
+      gchar *all;
+      gchar *parents;
+
+      end = urns->len;
+      parents = urns_to_list (urns, start, end);
+      all = urns_to_list (urns, 0, end);
+
+      if (moved_out)
+        select = g_strdup_printf ("SELECT ?urn "
+                                  "WHERE { ?urn nie:isPartOf ?parent . "
+                                  "FILTER (?parent IN (%s)) "
+                                  "FILTER NOT EXISTS { ?urn nie:isPartOf ?other . "
+                                  "FILTER (?other NOT IN (%s)) } }",
+                                  parents, all);
+      else
+        select = g_strdup_printf ("SELECT ?urn "
+                                  "WHERE { ?urn nie:isPartOf ?parent . "
+                                  "FILTER (?parent IN (%s)) }",
+                                  parents);
+
+      account_miner_job_query_urns (job, select, urns, seen, error);
+
+      g_free (select);
+      g_free (all);
+      g_free (parents);
+
+      start = end;
+    }
+
+  g_hash_table_unref (seen);
+
+  if (*error != NULL)
+    {
+      g_ptr_array_unref (urns);
+      return NULL;
+    }
+
+  return urns;
+}
+
+static void
+account_miner_job_delete_identifiers (GomAccountMinerJob *job,
+                                      GString *deletions,
+                                      GError **error)
+{
+  GPtrArray *urns;
+  GString *delete;
+  guint idx;
+
+  if (deletions->len == 0)
+    return;
+
+  /* the delta only mentions a deleted folder, not what it contained;
+   * something that is also part of a folder that stays was moved out
+   * of it
+   */
+  urns = account_miner_job_collect_subtrees (job, deletions->str, TRUE, error);
+  g_string_truncate (deletions, 0);
+
+  if (urns == NULL)
+    return;
+
+  if (urns->len == 0)
+    goto out;
+
+  delete = g_string_new ("DELETE { ");
+  for (idx = 0; idx < urns->len; idx++)
+    g_string_append_printf (delete, "<%s> a rdfs:Resource . ",
+                            (const gchar *) g_ptr_array_index (urns, idx));
+  g_string_append (delete, "}");
+
+  tracker_sparql_connection_update (job->connection,
+                                    delete->str,
+                                    G_PRIORITY_DEFAULT,
+                                    job->cancellable,
+                                    error);
+
+  g_string_free (delete, TRUE);
+
+ out:
+  g_ptr_array_unref (urns);
+}
+
+/* applies everything that changed since token, page by page, and
+ * returns the token to pass next time; "latest" gives back a token
+ * for the current state of the drive without any items
+ */
+static gchar *
+account_miner_job_sync_delta (GomAccountMinerJob *job,
+                              const gchar *token,
+                              GError **error)
+{
+  JsonParser *parser;
+  SoupSession *session;
+  ZpjAuthorizer *authorizer;
+  GString *deletions;
+  gchar *escaped;
+  gchar *new_token = NULL;
+  gchar *uri;
+
+  authorizer = zpj_skydrive_get_authorizer (ZPJ_SKYDRIVE (job->service));
+  deletions = g_string_new (NULL);
+  parser = json_parser_new ();
+  session = g_object_get_data (G_OBJECT (job->service), DELTA_SESSION_KEY);
+
+  escaped = g_uri_escape_string (token, NULL, FALSE);
+  uri = g_strconcat (DELTA_URI "?token=", escaped, NULL);
+  g_free (escaped);
+
+  while (uri != NULL)
+    {
+      GInputStream *stream;
+      JsonArray *items;
+      JsonNode *node;
+      JsonObject *object;
+      SoupMessage *message;
+      guint idx;
+
+      if (g_cancellable_set_error_if_cancelled (job->cancellable, error))
+        break;
+
+      message = soup_message_new (SOUP_METHOD_GET, uri);
+      if (message == NULL)
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                       "Invalid delta URI %s", uri);
+          break;
+        }
+
+      /* a cancellation interrupts the request itself, not only the
+       * loop between pages
+       */
+      zpj_authorizer_process_message (authorizer, NULL, message);
+      stream = soup_session_send (session, message, job->cancellable, error);
+      if (stream == NULL)
+        {
+          g_object_unref (message);
+          break;
+        }
+
+      if (!SOUP_STATUS_IS_SUCCESSFUL (message->status_code))
+        {
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                       "Delta request failed: %u %s",
+                       message->status_code, message->reason_phrase);
+          g_object_unref (stream);
+          g_object_unref (message);
+          break;
+        }
+
+      json_parser_load_from_stream (parser, stream, job->cancellable, error);
+      g_object_unref (stream);
+      g_object_unref (message);
 
       if (*error != NULL)
+        break;
+
+      node = json_parser_get_root (parser);
+      if (node == NULL || JSON_NODE_TYPE (node) != JSON_NODE_OBJECT)
         {
-          g_warning ("Unable to process entry %p: %s", l->data, (*error)->message);
-          g_clear_error (error);
+          g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                       "Unexpected delta response");
+          break;
         }
+
+      object = json_node_get_object (node);
+
+      if (json_object_has_member (object, "value"))
+        {
+          items = json_object_get_array_member (object, "value");
+
+          for (idx = 0; idx < json_array_get_length (items); idx++)
+            {
+              JsonObject *item;
+
+              item = json_array_get_object_element (items, idx);
+              account_miner_job_process_delta_item (job, item, deletions, error);
+
+              if (*error != NULL)
+                {
+                  g_warning ("Unable to process delta item: %s", (*error)->message);
+                  g_clear_error (error);
+                }
+            }
+        }
+
+      account_miner_job_delete_identifiers (job, deletions, error);
+
+      if (*error != NULL)
+        break;
+
+      g_free (uri);
+      uri = g_strdup (json_object_lookup_string (object, "@odata.nextLink"));
+
+      if (uri == NULL)
+        {
+          new_token = g_strdup (json_object_lookup_string (object, "@delta.token"));
+          if (new_token == NULL)
+            g_set_error (error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA,
+                         "Delta response without a token");
+        }
+    }
+
+  g_free (uri);
+  g_object_unref (parser);
+  g_string_free (deletions, TRUE);
+
+  return new_token;
+}
+
+/* keeps the folders with the given identifiers, and everything stored
+ * below them, out of the cleanup
+ */
+static void
+account_miner_job_keep_subtrees (GomAccountMinerJob *job,
+                                 const gchar *identifiers,
+                                 GError **error)
+{
+  GHashTable *kept;
+  GHashTableIter iter;
+  GPtrArray *kept_identifiers;
+  GPtrArray *urns;
+  gpointer identifier, resource;
+  guint idx;
+
+  urns = account_miner_job_collect_subtrees (job, identifiers, FALSE, error);
+  if (urns == NULL)
+    return;
+
+  kept = g_hash_table_new (g_str_hash, g_str_equal);
+  for (idx = 0; idx < urns->len; idx++)
+    g_hash_table_add (kept, g_ptr_array_index (urns, idx));
+
+  kept_identifiers = g_ptr_array_new_with_free_func (g_free);
+
+  g_hash_table_iter_init (&iter, job->previous_resources);
+  while (g_hash_table_iter_next (&iter, &identifier, &resource))
+    {
+      if (g_hash_table_contains (kept, resource))
+        g_ptr_array_add (kept_identifiers, g_strdup (identifier));
+    }
+
+  for (idx = 0; idx < kept_identifiers->len; idx++)
+    gom_account_miner_job_mark_kept (job, g_ptr_array_index (kept_identifiers, idx));
+
+  g_ptr_array_unref (kept_identifiers);
+  g_hash_table_unref (kept);
+  g_ptr_array_unref (urns);
+}
+
+static void
+account_miner_job_crawl (GomAccountMinerJob *job,
+                         GError **error)
+{
+  GomZpjMiner *self = GOM_ZPJ_MINER (job->miner);
+  GMainContext *context;
+  TraverseData data;
+
+  context = g_main_context_new ();
+  g_main_context_push_thread_default (context);
+
+  data.job = job;
+  data.unwalked = g_string_new (NULL);
+  data.incomplete = FALSE;
+  data.crawler = gom_crawler_new (self->priv->max_listings,
+                                  self->priv->max_depth,
+                                  account_miner_job_list_folder,
+                                  g_free,
+                                  &data,
+                                  job->cancellable);
+
+  gom_crawler_add (data.crawler, g_strdup (ZPJ_SKYDRIVE_FOLDER_SKYDRIVE), 0);
+
+  if (!gom_crawler_run (data.crawler, error))
+    goto out;
+
+  /* what was in the folders that could not be listed is unknown, so
+   * nothing is cleaned up this time around
+   */
+  if (data.incomplete)
+    {
+      g_hash_table_remove_all (job->previous_resources);
+      goto out;
     }
 
+  if (data.unwalked->len > 0)
+    account_miner_job_keep_subtrees (job, data.unwalked->str, error);
+
  out:
-  if (entries != NULL)
-    g_list_free_full (entries, g_object_unref);
+  g_string_free (data.unwalked, TRUE);
+  gom_crawler_free (data.crawler);
+  g_main_context_pop_thread_default (context);
+  g_main_context_unref (context);
 }
 
 static void
 query_zpj (GomAccountMinerJob *job,
            GError **error)
 {
-  account_miner_job_traverse_folder (job,
-                                     ZPJ_SKYDRIVE_FOLDER_SKYDRIVE,
-                                     error);
+  GomZpjMiner *self = GOM_ZPJ_MINER (job->miner);
+  GError *delta_error = NULL;
+  gchar *new_token = NULL;
+  gchar *token = NULL;
+
+  /* the service outlives the access token it was created with */
+  if (!zpj_authorizer_refresh_authorization
+      (zpj_skydrive_get_authorizer (ZPJ_SKYDRIVE (job->service)),
+       job->cancellable, error))
+    goto out;
+
+  if (!self->priv->delta)
+    {
+      account_miner_job_crawl (job, error);
+      goto out;
+    }
+
+  token = gom_account_miner_job_get_state (job, STATE_DELTA_TOKEN);
+  if (token != NULL)
+    {
+      new_token = account_miner_job_sync_delta (job, token, &delta_error);
+      if (new_token != NULL)
+        {
+          /* deletions came with the delta, and everything else is
+           * still there
+           */
+          g_hash_table_remove_all (job->previous_resources);
+          gom_account_miner_job_set_state (job, STATE_DELTA_TOKEN, new_token);
+          goto out;
+        }
+
+      gom_account_miner_job_set_state (job, STATE_DELTA_TOKEN, NULL);
+
+      if (g_error_matches (delta_error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        {
+          g_propagate_error (error, delta_error);
+          goto out;
+        }
+
+      g_warning ("Unable to sync changes, crawling everything: %s", delta_error->message);
+      g_clear_error (&delta_error);
+    }
+
+  /* take the token before crawling, so that whatever changes while
+   * the crawl is running is picked up next time
+   */
+  new_token = account_miner_job_sync_delta (job, "latest", &delta_error);
+  if (delta_error != NULL)
+    {
+      g_warning ("Unable to get a delta token: %s", delta_error->message);
+      g_clear_error (&delta_error);
+    }
+
+  account_miner_job_crawl (job, error);
+
+  if (*error == NULL && new_token != NULL)
+    gom_account_miner_job_set_state (job, STATE_DELTA_TOKEN, new_token);
+
+ out:
+  g_free (new_token);
+  g_free (token);
 }
 
 static GObject *
@@ -268,6 +1000,9 @@ create_service (GomMiner *self,
   authorizer = zpj_goa_authorizer_new (object);
   service = zpj_skydrive_new (ZPJ_AUTHORIZER (authorizer));
 
+  g_object_set_data_full (G_OBJECT (service), DELTA_SESSION_KEY,
+                          soup_session_new (), g_object_unref);
+
   /* the service takes ownership of the authorizer */
   g_object_unref (authorizer);
 
@@ -277,7 +1012,22 @@ create_service (GomMiner *self,
 static void
 gom_zpj_miner_init (GomZpjMiner *self)
 {
+  const gchar *max_depth;
+  const gchar *max_listings;
+
+  self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, GOM_TYPE_ZPJ_MINER, GomZpjMinerPrivate);
+  self->priv->max_depth = DEFAULT_MAX_DEPTH;
+  self->priv->max_listings = DEFAULT_MAX_LISTINGS;
 
+  max_listings = g_getenv ("ZPJ_MINER_MAX_LISTINGS");
+  if (max_listings != NULL)
+    self->priv->max_listings = MAX (1, g_ascii_strtoull (max_listings, NULL, 10));
+
+  max_depth = g_getenv ("ZPJ_MINER_MAX_DEPTH");
+  if (max_depth != NULL)
+    self->priv->max_depth = g_ascii_strtoull (max_depth, NULL, 10);
+
+  self->priv->delta = (g_getenv ("ZPJ_MINER_DELTA") != NULL);
 }
 
 static void
@@ -291,4 +1041,6 @@ gom_zpj_miner_class_init (GomZpjMinerClass *klass)
 
   miner_class->create_service = create_service;
   miner_class->query = query_zpj;
+
+  g_type_class_add_private (klass, sizeof (GomZpjMinerPrivate));
 }